@@ -9,7 +9,9 @@
   CannyFS needs TBB, Boost, and a reasonably C++14-compliant compiler.
 
   Compiled like this:
-  g++ cannyfs.cpp -std=c++14 -O3 -lfuse -ltbb -lpthread -lboost_filesystem -lboost_system -D_FILE_OFFSET_BITS=64
+  g++ cannyfs.cpp -std=c++14 -O3 `pkg-config fuse3 --cflags --libs` -ltbb -lpthread -lboost_filesystem -lboost_system -D_FILE_OFFSET_BITS=64
+
+  libfuse 2 is still supported, with -DFUSE_USE_VERSION=26 and -lfuse instead of the pkg-config part.
 
 
   Based on:
@@ -22,7 +24,9 @@
   See the file COPYING.
 */
 
-#define FUSE_USE_VERSION 26
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 32
+#endif
 
 #define _GNU_SOURCE
 
@@ -37,6 +41,7 @@
 
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #ifdef HAVE_LIBULOCKMGR
 #include <ulockmgr.h>
@@ -68,9 +73,21 @@
 #include <condition_variable>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <string>
 #include <functional>
 #include <queue>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <chrono>
+
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <limits.h>
 
 
 // TODO: Remove TBB dependency?
@@ -101,6 +118,7 @@ struct cannyfs_options
 	ALIGNBOOL eagerfsync = true;
 	ALIGNBOOL eagerlink = true;
 	ALIGNBOOL eagermkdir = true;
+	ALIGNBOOL eageropen = true;
 	ALIGNBOOL eagerrename = true;
 	ALIGNBOOL eagerrmdir = true;
 	ALIGNBOOL eagersymlink = true;
@@ -111,1367 +129,6118 @@ struct cannyfs_options
 	ALIGNBOOL verbose = false;
 	ALIGNBOOL assumecreateddirempty = true;
 	ALIGNBOOL cachemissing = true;
+	ALIGNBOOL completedirs = true;
+	ALIGNBOOL memorylistings = true;
+	ALIGNBOOL overlaydirs = true;
 	ALIGNBOOL closeverylate = false; // TODO: Expose when implemented
 	ALIGNBOOL dieonerror = true;
 	ALIGNBOOL ignorefsync = true;
 	ALIGNBOOL inaccuratestat = true;
 	ALIGNBOOL restrictivedirs = false;
 	ALIGNBOOL statwhenreaddir = true;
+	ALIGNBOOL stagedreads = true;
+	ALIGNBOOL rangebarriers = true;
+	ALIGNBOOL elideunlinked = true;
+	ALIGNBOOL fuserenames = true;
 	ALIGNBOOL veryeageraccess = true;
+	ALIGNBOOL lowlevel = false;
+	ALIGNBOOL writeback = true;
+	ALIGNBOOL readdirplus = true;
+	ALIGNBOOL clonefd = true;
+	int maxidlethreads = 0;
+	const char* backend = "sync";
+	int uringentries = 1024;
 	int maxinflight = 300;
+	long long maxinflightbytes = 256 << 20;
+	long long maxpipebytes = 64 << 20;
+	long long packsmallfiles = 64 << 10;
+	int workers = 64;
+	int maxtrackedpaths = 0;
+	int maxdirfds = 128;
 } options;
 
+// Whether the kernel runs a writeback cache for us, decided at init
+bool writebackcache = false;
+
 atomic_llong eventId(0);
 atomic_llong retiredCount(0);
 
-struct cannyfs_filedata
-{
-	const bf::path path;
-
-	mutex datalock;
-	mutex oplock;
-	atomic_llong firstEventId{ -1 };
-	atomic_llong lastEventId{ -1 };
-	bool running = false;
-
-	// Kill it if we don't have any ops.
-	// TODO: What if file is closed with close list?
-	// long long numOps;
-	condition_variable processed;
-
-	queue<function<int(void)> > ops;
-	set<cannyfs_filedata*> removers;
+// -1 for threads that are not pool workers, -2 for temporary (compensating) pool workers
+thread_local int cannyfs_workerindex = -1;
 
-	void waitremove()
+// Fixed-size work-stealing pool running the per-file op queues.
+// Ops can wait on other files (parent dirs, pending opens). A worker doing that reports itself as
+// blocked, and if no runnable worker remains while tasks are queued, a temporary worker is started.
+struct cannyfs_pool
+{
+private:
+	struct workerqueue
 	{
-		// TODO: Should really capture remover state at point of rmdir submission
-		// If same dirname is recreated and files removed from that one as well, bad things will happen
-		set<cannyfs_filedata*> toremove;
-		{
-			unique_lock<mutex> _(datalock);
-			toremove = removers;
-		}
+		mutex lock;
+		deque<function<void()> > tasks;
+	};
 
-		for (auto filedata : toremove)
+	vector<unique_ptr<workerqueue> > queues;
+	vector<thread> threads;
+	mutex idlelock;
+	condition_variable wakeup;
+	once_flag started;
+	atomic_uint next{ 0 };
+	atomic_llong queued{ 0 };
+	atomic_int runnable{ 0 };
+	bool stopping = false;
+	chrono::steady_clock::time_point starttime;
+
+	bool take(int index, function<void()>& task)
+	{
+		int count = queues.size();
+		if (index >= 0)
 		{
-			filedata->sync();
+			workerqueue& own = *queues[index];
+			lock_guard<mutex> _(own.lock);
+			if (!own.tasks.empty())
+			{
+				task = move(own.tasks.front());
+				own.tasks.pop_front();
+				queued--;
+				return true;
+			}
 		}
 
+		int start = index >= 0 ? index + 1 : next++;
+		for (int i = 0; i < count; i++)
 		{
-			unique_lock<mutex> _(datalock);
-			// Highly inefficient
-			for (auto filedata : toremove)
+			int victim = (start + i) % count;
+			if (victim == index) continue;
+			workerqueue& other = *queues[victim];
+			lock_guard<mutex> _(other.lock);
+			if (!other.tasks.empty())
 			{
-				removers.erase(filedata);
+				task = move(other.tasks.back());
+				other.tasks.pop_back();
+				queued--;
+				steals++;
+				return true;
 			}
 		}
-	}
 
-	struct stat stats = {};
-	std::atomic<off_t> size{ 0 };
-	atomic_bool hastruestat{ false };
-	atomic_bool created{ false };
-	atomic_bool missing{ false };
+		return false;
+	}
 
-	cannyfs_filedata(const string& name) : path(name)
+	void execute(function<void()>& task)
 	{
+		int nowbusy = ++busy;
+		update_peak(nowbusy);
+		auto before = chrono::steady_clock::now();
+		task();
+		busyusec += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - before).count();
+		busy--;
+		executed++;
 	}
 
-	cannyfs_filedata(const bf::path& name) : path(name)
+	void update_peak(int value)
 	{
+		int prev = peakbusy;
+		while (prev < value && !peakbusy.compare_exchange_weak(prev, value));
 	}
 
-	void run();
-
-	// Spin 'til all our events have been handled, or at least up to the passed ID
-	void spinevent(unique_lock<mutex>& locallock, long long targetEvent = numeric_limits<long long>::max())
+	void workerloop(int index)
 	{
-	  long long eventId = min((long long) lastEventId, targetEvent);
-		while (firstEventId < eventId)
+		cannyfs_workerindex = index;
+		function<void()> task;
+		while (true)
 		{
-			processed.wait(locallock);
+			if (take(index, task))
+			{
+				execute(task);
+				task = nullptr;
+				continue;
+			}
+
+			// Temporary workers only live as long as there is a backlog
+			if (index < 0) break;
+
+			unique_lock<mutex> _(idlelock);
+			if (stopping) break;
+			wakeup.wait(_, [this] { return stopping || queued > 0; });
 		}
+		runnable--;
 	}
 
-	void sync()
+	// Call with idlelock held
+	void compensate()
 	{
-		unique_lock<mutex> locallock(datalock);
-		spinevent(locallock);
+		if (runnable <= 0 && queued > 0 && !stopping)
+		{
+			runnable++;
+			compensating++;
+			thread([this] { workerloop(-2); }).detach();
+		}
 	}
-};
-
-struct cannyfs_filehandle
-{
-	mutex lock;
-	int64_t fd;
-	condition_variable opened;
 
-	cannyfs_filehandle() : fd(-1)
+	void start()
 	{
+		int count = max(options.workers, 1);
+		starttime = chrono::steady_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			queues.emplace_back(new workerqueue);
+		}
+		runnable = count;
+		for (int i = 0; i < count; i++)
+		{
+			threads.emplace_back([this, i] { workerloop(i); });
+		}
 	}
 
-	~cannyfs_filehandle()
+public:
+	atomic_llong executed{ 0 };
+	atomic_llong steals{ 0 };
+	atomic_llong compensating{ 0 };
+	atomic_llong busyusec{ 0 };
+	atomic_int busy{ 0 };
+	atomic_int peakbusy{ 0 };
+
+	void submit(function<void()> task)
 	{
-		// We might want to report the error up
-		/*if (fd != -1)
+		// Started lazily, since fuse_main might fork when daemonizing
+		call_once(started, [this] { start(); });
+
+		int index = cannyfs_workerindex >= 0 ? cannyfs_workerindex : (int) (next++ % queues.size());
 		{
-			close(fd);
-		}*/
+			workerqueue& target = *queues[index];
+			lock_guard<mutex> _(target.lock);
+			target.tasks.push_back(move(task));
+			queued++;
+		}
+
+		lock_guard<mutex> _(idlelock);
+		wakeup.notify_one();
+		compensate();
 	}
 
-	void setfh(uint64_t fd)
+	void blocking()
 	{
-		lock_guard<mutex> locallock(lock);
-		this->fd = fd;
-		opened.notify_all();
+		if (cannyfs_workerindex == -1) return;
+		lock_guard<mutex> _(idlelock);
+		runnable--;
+		compensate();
 	}
 
-	uint64_t getfh()
+	void unblocking()
+	{
+		if (cannyfs_workerindex == -1) return;
+		runnable++;
+	}
+
+	void stop()
 	{
-		unique_lock<mutex> locallock(lock);
-		while (fd == -1)
 		{
-			opened.wait(locallock);
+			lock_guard<mutex> _(idlelock);
+			stopping = true;
+			wakeup.notify_all();
+		}
+		for (auto& worker : threads)
+		{
+			worker.join();
 		}
-
-		return fd;
 	}
-};
-
-typedef concurrent_vector<cannyfs_filehandle> fhstype;
-fhstype fhs;
-boost::lockfree::stack<fhstype::iterator> freefhs(16);
-concurrent_vector<string> errors;
 
-typedef pair<int, int> cannyfs_pipefds;
+	void report()
+	{
+		if (threads.empty()) return;
+		double elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - starttime).count();
+		double utilization = elapsed > 0 ? 100.0 * busyusec / (elapsed * threads.size()) : 0;
+		cerr << "[cannyfs] Worker pool: " << threads.size() << " workers, " << executed << " tasks, "
+			<< steals << " stolen, peak " << peakbusy << " busy, " << compensating << " temporary workers, "
+			<< utilization << "% utilization.\n";
+	}
+} workqueue;
 
-namespace boost
+// Marks a pool worker as blocked for the lifetime of the object
+struct cannyfs_blocked
 {
-template <class T, class U> struct has_trivial_assign<std::pair<T,U> > :
-	integral_constant<bool,
-	(has_trivial_assign<T>::value &&
-	has_trivial_assign<U>::value)> { };
-}
+	cannyfs_blocked() { workqueue.blocking(); }
+	~cannyfs_blocked() { workqueue.unblocking(); }
+};
 
-struct cannyfs_pipes
+void cannyfs_letgoall();
+
+// Admission control for --maxinflight and --maxinflightbytes. Requests over either limit block until
+// enough ops have been retired, and are woken in arrival order as soon as their own event fits.
+struct cannyfs_admission
 {
 private:
-	boost::lockfree::stack<cannyfs_pipefds> freepipes;
+	struct waiter
+	{
+		long long eventId;
+		long long bytes;
+		bool admitted = false;
+		condition_variable wake;
+	};
+
+	mutex lock;
+	deque<waiter*> waiters;
+	atomic_int numwaiters{ 0 };
+	// Charged by ops not admitted yet. They don't hold up anyone, or the waiters alone could fill the budget
+	// with nothing left to retire.
+	atomic_llong waitingbytes{ 0 };
+
+	bool fits(long long eventId, long long bytes)
+	{
+		if (eventId - retiredCount > options.maxinflight) return false;
+
+		// An op bigger than the whole budget is let through once it is alone
+		long long others = inflightbytes - waitingbytes;
+		return options.maxinflightbytes <= 0 || others + bytes <= options.maxinflightbytes || others <= 0;
+	}
+
 public:
-	cannyfs_pipes() : freepipes(100)
-	{}
+	atomic_llong inflightbytes{ 0 };
+	atomic_llong peakbytes{ 0 };
+	atomic_llong blockedcount{ 0 };
+	atomic_llong blockedusec{ 0 };
 
-	cannyfs_pipefds getpipe()
+	// Account for the memory held by a pending op, until it is retired. It counts against the budget once admitted.
+	void charge(long long bytes)
 	{
-		cannyfs_pipefds pipe;
-		if (!freepipes.pop(pipe))
+		waitingbytes += bytes;
+		long long nowbytes = inflightbytes += bytes;
+		long long prev = peakbytes;
+		while (prev < nowbytes && !peakbytes.compare_exchange_weak(prev, nowbytes));
+	}
+
+	void admit(long long eventId, long long bytes)
+	{
+		if (!numwaiters && fits(eventId, bytes))
+		{
+			waitingbytes -= bytes;
+			return;
+		}
+
+		// The ops of held files count against the limits too, but won't be retired until they are let go
+		cannyfs_letgoall();
+
+		auto before = chrono::steady_clock::now();
 		{
-			if (::pipe(&pipe.first) == -1)
+			unique_lock<mutex> locallock(lock);
+			// Registered before checking, so that a concurrent retire() can't miss us
+			numwaiters++;
+			if (fits(eventId, bytes))
+			{
+				numwaiters--;
+				waitingbytes -= bytes;
+				return;
+			}
+
+			waiter self;
+			self.eventId = eventId;
+			self.bytes = bytes;
+			waiters.push_back(&self);
+			cannyfs_blocked blocked;
+			while (!self.admitted)
 			{
-				cerr << "Unable to get pipe, errno " << errno << "." << std::endl;
-				abort();
+				self.wake.wait(locallock);
 			}
 		}
 
-		return pipe;
+		blockedcount++;
+		blockedusec += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - before).count();
 	}
 
-	void returnpipe(cannyfs_pipefds pipe)
+	void retire(long long bytes)
 	{
-		// TODO: Make fixed size, push will never return false now
-		if (!freepipes.push(pipe))
+		inflightbytes -= bytes;
+		retiredCount++;
+		if (!numwaiters) return;
+
+		lock_guard<mutex> _(lock);
+		for (auto i = waiters.begin(); i != waiters.end();)
 		{
-			close(pipe.first);
-			close(pipe.second);
+			waiter* w = *i;
+			if (fits(w->eventId, w->bytes))
+			{
+				// Counted from here on, for the waiters after it
+				waitingbytes -= w->bytes;
+				w->admitted = true;
+				w->wake.notify_one();
+				i = waiters.erase(i);
+				numwaiters--;
+			}
+			else
+			{
+				++i;
+			}
 		}
 	}
-} piper;
 
-fhstype::iterator getnewfh()
-{
-	fhstype::iterator toreturn;
-	if (freefhs.pop(toreturn))
+	void report()
 	{
-		return toreturn;
+		cerr << "[cannyfs] Admission: " << blockedcount << " requests blocked, "
+			<< blockedusec / 1000 << " ms total blocked time, peak " << (peakbytes >> 10) << " KiB in flight.\n";
 	}
-	return fhs.grow_by(1);
-}
-
-cannyfs_filehandle* getcfh(int fd)
-{
-	return &fhs[fd];
-}
-
-uint64_t getfh(const fuse_file_info* fi)
-{
-	return getcfh(fi->fh)->getfh();
-}
+} admission;
 
-int cannyfs_guarderror(bool defer, const char* funcname, const std::string& path, int res)
+// Hashes are computed once per path and used both to pick the shard and as the key within it
+struct cannyfs_identityhash
 {
-	if (defer && res < 0)
+	size_t operator()(size_t hash) const
 	{
-		stringstream error;
-		error << "ERROR: " << funcname << " for " << path;
-		cerr << error.str() << "\n";
-		if (options.dieonerror)
-		{
-			abort();
-		}
-		errors.push_back(error.str());
+		return hash;
 	}
+};
 
-	return res;
-}
-
-struct cannyfs_closer
+// FNV-1a, so that we can hash a path without first copying it into a string
+inline size_t cannyfs_hashpath(const char* path, size_t len)
 {
-private:
-	int fd;
-public:
-	cannyfs_closer() = delete;
-	cannyfs_closer(int fd) : fd(fd) {}
-	~cannyfs_closer()
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
 	{
-		cannyfs_guarderror(true, "cannyfs_closer", "<path not known at this point>", close(fd));
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ULL;
 	}
-};
-
-const int NO_BARRIER = 1;
-const int JUST_BARRIER = 0;
-const int LOCK_WHOLE = 2;
-const int DIR_LOCK = 4;
 
-vector<cannyfs_closer> closes;
+	return hash;
+}
 
-struct comp {
-	bool operator()(const cannyfs_filedata& lhs, const cannyfs_filedata& rhs)
+struct cannyfs_pathnode
+{
+	atomic_int refs{ 1 };
+	const size_t hash;
+	// Holds a reference, null only for the empty path
+	cannyfs_pathnode* const parent;
+	const string path;
+
+	cannyfs_pathnode(size_t hash, cannyfs_pathnode* parent, const char* path, size_t len) :
+		hash(hash), parent(parent), path(path, len)
 	{
-		return lhs.path < rhs.path;
 	}
 };
 
-struct cannyfs_filemap
+// Every path we deal with is stored once in here, and handed around as a cannyfs_path.
+// Nodes are reference counted. A node only drops to zero references under its shard lock,
+// and lookups only take new references under the same lock.
+struct cannyfs_paths
 {
 private:
-	set<cannyfs_filedata, comp> data;
-	shared_timed_mutex lock;
-public:
-	atomic_bool syncnow = { false };
-	vector<cannyfs_filedata*> shallowcopy()
+	static const int SHARDS = 64;
+
+	struct shard
 	{
-		shared_lock<shared_timed_mutex> maplock(this->lock);
-		vector<cannyfs_filedata*> res;
-		res.reserve(data.size());
-		for (auto& filedata : data)
+		unordered_multimap<size_t, cannyfs_pathnode*, cannyfs_identityhash> nodes;
+		shared_timed_mutex lock;
+
+		cannyfs_pathnode* find(size_t hash, const char* path, size_t len)
 		{
-			res.push_back(const_cast<cannyfs_filedata*>(&filedata));
+			auto range = nodes.equal_range(hash);
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				const string& candidate = i->second->path;
+				if (candidate.size() == len && !memcmp(candidate.data(), path, len))
+				{
+					return i->second;
+				}
+			}
+
+			return nullptr;
 		}
+	};
 
-		return res;
-	}
+	shard shards[SHARDS];
 
-	void syncall(bool silent = false)
+	// Length of the parent path, bf::path::parent_path style: "/a/b" -> "/a", "/a" -> "/", "/" -> ""
+	static size_t parentlength(const char* path, size_t len)
 	{
-		for (auto filedata : shallowcopy())
-		{
-			filedata->sync();
-		}
-		if (!silent) cerr << "[cannyfs] Global file sync completed." << std::endl;
+		if (len <= 1) return 0;
+
+		size_t pos = len - 1;
+		while (pos > 0 && path[pos] != '/') pos--;
+
+		return (pos == 0 && path[0] == '/') ? 1 : pos;
 	}
 
-	void pollsync()
+public:
+	atomic_llong live{ 0 };
+
+	// Returns the node with a reference taken for the caller
+	cannyfs_pathnode* intern(const char* path, size_t len)
 	{
-		bool now = false;
-		now = syncnow.exchange(now);
-		if (now)
+		size_t hash = cannyfs_hashpath(path, len);
+		shard& s = shards[hash % SHARDS];
 		{
-			cerr << "[cannyfs] Initializing global file sync." << std::endl;
+			shared_lock<shared_timed_mutex> _(s.lock);
+			cannyfs_pathnode* node = s.find(hash, path, len);
+			if (node)
+			{
+				node->refs++;
+				return node;
+			}
 		}
-	}
-
-	cannyfs_filedata* get(const bf::path& path, bool always, unique_lock<mutex>& lock, bool lockdata = false)
-	{
-		cannyfs_filedata* result = nullptr;
-		auto locktransferline = [&] { lock = unique_lock<mutex>(lockdata ? result->datalock : result->oplock); };
 
+		cannyfs_pathnode* parent = len ? intern(path, parentlength(path, len)) : nullptr;
 		{
-			shared_lock<shared_timed_mutex> maplock(this->lock);
-			auto i = data.find(path);
-			if (i != data.end())
+			unique_lock<shared_timed_mutex> _(s.lock);
+			cannyfs_pathnode* node = s.find(hash, path, len);
+			if (!node)
 			{
-				result = const_cast<cannyfs_filedata*>(&*i);
-				maplock.unlock();
-				locktransferline();
+				node = new cannyfs_pathnode(hash, parent, path, len);
+				s.nodes.emplace(hash, node);
+				live++;
+				return node;
 			}
+			node->refs++;
 		}
 
-		if (always && !result)
+		// Someone else interned it in the meantime
+		if (parent) release(parent);
+		return intern(path, len);
+	}
+
+	void release(cannyfs_pathnode* node)
+	{
+		while (node)
 		{
-			unique_lock<shared_timed_mutex> maplock(this->lock);
-			auto i = data.find(path);
-			if (i != data.end())
+			int refs = node->refs;
+			if (refs > 1)
 			{
-				result = const_cast<cannyfs_filedata*>(&*i);
+				if (node->refs.compare_exchange_weak(refs, refs - 1)) return;
+				continue;
 			}
-			else
+
+			cannyfs_pathnode* parent = nullptr;
 			{
-				result = const_cast<cannyfs_filedata*>(&(*data.emplace(path).first));
+				shard& s = shards[node->hash % SHARDS];
+				unique_lock<shared_timed_mutex> _(s.lock);
+				if (--node->refs) return;
+
+				auto range = s.nodes.equal_range(node->hash);
+				for (auto i = range.first; i != range.second; ++i)
+				{
+					if (i->second == node)
+					{
+						s.nodes.erase(i);
+						break;
+					}
+				}
+				parent = node->parent;
+				delete node;
+				live--;
 			}
-			maplock.unlock();
-			locktransferline();
+
+			node = parent;
 		}
+	}
 
-		return result;
+	void report()
+	{
+		cerr << "[cannyfs] Path arena: " << live << " paths interned.\n";
 	}
-} filemap;
+} paths;
 
-struct cannyfs_reader
+class cannyfs_path;
+
+// Paths the low-level frontend already resolved for the op running on this thread.
+// The path based ops get their c_str(), and converting that back must not need another lookup.
+thread_local const cannyfs_path* cannyfs_resolvedpaths[2] = {};
+
+// Handle to an interned path. Copying it is just a reference count increment.
+class cannyfs_path
 {
-public:
-	unique_lock<mutex> lock;
-	cannyfs_filedata* fileobj;
-	cannyfs_reader(const bf::path& path, int flag, long long targetEvent = numeric_limits<long long>::max())
-	{
-		if (options.verbose) fprintf(stderr, "Waiting for reading %s, with flags %d\n", path.c_str(), flag);
+private:
+	cannyfs_pathnode* node;
 
-		unique_lock<mutex> locallock;
-		fileobj = filemap.get(path, flag & LOCK_WHOLE, locallock, true);
+	explicit cannyfs_path(cannyfs_pathnode* node) : node(node)
+	{
+		node->refs++;
+	}
 
-		if (!(flag & NO_BARRIER) && fileobj)
+	static cannyfs_pathnode* resolve(const char* path)
+	{
+		for (const cannyfs_path* resolved : cannyfs_resolvedpaths)
 		{
-			fileobj->spinevent(locallock, targetEvent);
+			if (resolved && resolved->c_str() == path)
+			{
+				resolved->node->refs++;
+				return resolved->node;
+			}
 		}
 
-		if (flag & LOCK_WHOLE)
-		{
-			swap(lock, locallock);
-		}
+		return paths.intern(path, strlen(path));
+	}
 
-		if (options.verbose) fprintf(stderr, "Got reader lock %s\n", path.c_str());
+public:
+	cannyfs_path(const char* path) : node(resolve(path))
+	{
 	}
-};
 
-// Snippet from http://stackoverflow.com/questions/16190078/how-to-atomically-update-a-maximum-value
-template<typename T>
-void update_maximum(std::atomic<T>& maximum_value, T const& value) noexcept
-{
-	T prev_value = maximum_value;
-	while (prev_value < value &&
-		!maximum_value.compare_exchange_weak(prev_value, value))
-		;
-}
+	cannyfs_path(const string& path) : node(paths.intern(path.data(), path.size()))
+	{
+	}
 
-struct cannyfs_dirreader : cannyfs_reader
-{
-private:
-public:
-	cannyfs_dirreader() = delete;
-	cannyfs_dirreader(const bf::path& path, int flag) :
-		cannyfs_reader(path, flag)
+	cannyfs_path(const cannyfs_path& other) : node(other.node)
 	{
+		node->refs++;
 	}
-};
 
-// Ensure that the parent directory exists, no-op unless eagermkdir is on
-template<class T> void ensure_parent(T path, long long targetEvent = numeric_limits<long long>::max())
-{
-	if (options.eagermkdir)
+	cannyfs_path& operator=(const cannyfs_path& other)
 	{
-		// If we create dirs willy-nilly, we need to wait before we do stuff to entries within those dirs
-		cannyfs_reader parentdir(((const bf::path&&) path).parent_path(), JUST_BARRIER, targetEvent);
+		other.node->refs++;
+		paths.release(node);
+		node = other.node;
+		return *this;
 	}
-}
 
-struct cannyfs_writer
-{
-private:
-	unique_lock<mutex> lock;
-	cannyfs_filedata* fileobj;
-	long long eventId;
-	bool global;
-public:
-	cannyfs_writer(const bf::path& path, int flag, long long eventId, bool dir = false) : eventId(eventId), global(path == "")
+	~cannyfs_path()
 	{
-		ensure_parent(path, eventId);
+		paths.release(node);
+	}
 
-		if (options.verbose) fprintf(stderr, "Entering write lock for %s\n", path.c_str());
-		fileobj = filemap.get(path, true, lock);
+	const char* c_str() const
+	{
+		return node->path.c_str();
+	}
 
-		if (flag != LOCK_WHOLE)
-		{
-			if (options.verbose) fprintf(stderr, "Leaving write lock early for %s\n", path.c_str());
-			lock.unlock();
-		}
+	const string& str() const
+	{
+		return node->path;
+	}
 
-		if (dir)
-		{
-			// Removers are considered all fatally directory-altering events. unlink is always one.
-			fileobj->waitremove();
-		}
+	size_t hash() const
+	{
+		return node->hash;
+	}
 
-		if (!global && options.restrictivedirs)
-		{
-			if (dir)
-			{
-				// We are a dir
-				cannyfs_dirreader(path, JUST_BARRIER);
-			}
-			unique_lock<mutex> globallock;
-			cannyfs_filedata* globalfileobj = filemap.get("", true, globallock, true);
-			update_maximum(globalfileobj->lastEventId, eventId);
-		}
+	bool empty() const
+	{
+		return node->path.empty();
 	}
 
-	~cannyfs_writer()
+	// Interned paths are equal exactly when they are the same node
+	bool operator==(const cannyfs_path& other) const
 	{
-		unique_lock<mutex> endlock(fileobj->datalock);
-		update_maximum(fileobj->firstEventId, eventId);
-		fileobj->processed.notify_all();
+		return node == other.node;
+	}
 
-		if (!global && options.restrictivedirs)
+	cannyfs_path parent() const
+	{
+		return cannyfs_path(node->parent ? node->parent : node);
+	}
+
+	cannyfs_path child(const char* name) const
+	{
+		string childpath = node->path;
+		if (childpath.empty() || childpath.back() != '/')
 		{
-			cannyfs_writer("", JUST_BARRIER, eventId);
+			childpath += '/';
 		}
-		if (options.verbose) fprintf(stderr, "Leaving write lock for %s\n", fileobj->path.c_str());
+		childpath += name;
+
+		return cannyfs_path(childpath);
+	}
+
+	// Last component
+	string name() const
+	{
+		size_t slash = node->path.rfind('/');
+		return slash == string::npos ? node->path : node->path.substr(slash + 1);
 	}
 };
 
-void cannyfs_filedata::run()
+struct cannyfs_pendingwrite;
+
+const uint8_t OP_OTHER = 0;
+const uint8_t OP_CREATE = 1;
+const uint8_t OP_WRITE = 2;
+const uint8_t OP_FLUSH = 3;
+const uint8_t OP_RELEASE = 4;
+// The deferred open of an existing file
+const uint8_t OP_OPEN = 5;
+
+struct cannyfs_op
 {
-	unique_lock<mutex> locallock(this->datalock);
-	running = true;
-	while (!ops.empty())
-	{
-		function<int(void)> op = ops.front();
-		ops.pop();
+	function<int(void)> run;
+	// Set for write_buf ops, so that contiguous writes can be coalesced
+	shared_ptr<cannyfs_pendingwrite> write;
+	// Ops on a file handle, so that its whole life can go to the backend as one chain
+	uint8_t kind = OP_OTHER;
+	uint64_t fh = 0;
+	long long eventId = 0;
+	// Charged to admission control, retired by run
+	long long bytes = 0;
+};
 
-		locallock.unlock();
-		op();
-		locallock.lock();
+// The parts of struct stat that we model, packed. The size is kept separately.
+struct cannyfs_stat
+{
+	uint64_t dev = 0;
+	uint64_t ino = 0;
+	uint64_t rdev = 0;
+	// -1 until taken from a true stat
+	int64_t blocks = -1;
+	int64_t atime = 0;
+	int64_t mtime = 0;
+	int64_t ctime = 0;
+	uint32_t atimensec = 0;
+	uint32_t mtimensec = 0;
+	uint32_t ctimensec = 0;
+	uint32_t mode = 0;
+	uint32_t uid = 0;
+	uint32_t gid = 0;
+	uint32_t nlink = 0;
+	uint32_t blksize = 0;
+
+	cannyfs_stat& operator=(const struct stat& st)
+	{
+		dev = st.st_dev;
+		ino = st.st_ino;
+		rdev = st.st_rdev;
+		atime = st.st_atim.tv_sec;
+		mtime = st.st_mtim.tv_sec;
+		ctime = st.st_ctim.tv_sec;
+		atimensec = st.st_atim.tv_nsec;
+		mtimensec = st.st_mtim.tv_nsec;
+		ctimensec = st.st_ctim.tv_nsec;
+		mode = st.st_mode;
+		uid = st.st_uid;
+		gid = st.st_gid;
+		nlink = st.st_nlink;
+		blocks = st.st_blocks;
+		blksize = st.st_blksize;
+
+		return *this;
 	}
-	running = false;
-}
 
-int cannyfs_add_write_inner(bool defer, const std::string& path, auto fun)
-{
-	filemap.pollsync();
+	// Block counts are made up from the size for what we made, or have no true stat of
+	void fill(struct stat* st, off_t size, bool made) const
+	{
+		*st = {};
+		st->st_dev = dev;
+		st->st_ino = ino;
+		st->st_rdev = rdev;
+		st->st_atim = { (time_t) atime, (long) atimensec };
+		st->st_mtim = { (time_t) mtime, (long) mtimensec };
+		st->st_ctim = { (time_t) ctime, (long) ctimensec };
+		st->st_mode = mode;
+		st->st_uid = uid;
+		st->st_gid = gid;
+		st->st_nlink = nlink;
+		st->st_size = size;
+		const bool real = !made && blocks >= 0;
+		st->st_blksize = real ? blksize : 4096;
+		st->st_blocks = real ? blocks : (size + 511) / 512;
+	}
+};
 
-	long long eventIdNow;
+struct cannyfs_filedata;
 
-	unique_lock<mutex> lock;
-	cannyfs_filedata* fileobj = filemap.get(path, true, lock, true);
+// Everything needed to queue and wait for ops on a path. Only allocated while there is something
+// pending, most paths are only ever stat'ed. Held by shared_ptr, so that a writer or waiter can
+// hold on to it while the path is trimmed.
+struct cannyfs_opstate
+{
+	mutex oplock;
+	atomic_llong firstEventId{ -1 };
+	atomic_llong lastEventId{ -1 };
+	bool running = false;
 
-	eventIdNow = ++::eventId;
+	// Kill it if we don't have any ops.
+	// TODO: What if file is closed with close list?
+	// long long numOps;
+	condition_variable processed;
 
-	if (!defer) fileobj->spinevent(lock);
+	deque<cannyfs_op> ops;
+	// Entries in here are pinned, so they can't be reclaimed while we might still wait for them
+	set<cannyfs_filedata*> removers;
+	// Children on their way to the backend, by the number of ops that still have to put them there.
+	// Guarded by datalock, not oplock.
+	map<string, int> pendingchildren;
+	// The last op other than a handle's open, writes and release. Reads served without a barrier wait for it.
+	atomic_llong lastOtherEventId{ -1 };
+	// Payloads of queued write_buf ops by offset, until they are on the backend. A read only waits for
+	// those it overlaps, or is served from them with --stagedreads. Guarded by datalock.
+	multimap<off_t, shared_ptr<cannyfs_pendingwrite> > staged;
+	int maxstaged = 0;
+	// Queued ops up to this event are for a file that was unlinked before it reached the backend, run skips them
+	long long elidedThrough = -1;
+	// A rename or link from this path is queued, which needs the file made by the ops up to this event on the backend
+	long long sourcedThrough = -1;
+	// A created file's queue waits for its release with --packsmallfiles, so that it goes to the backend as one
+	// open, write and close. Anyone who needs the file before that lets it go. Holds the bytes written so far.
+	bool held = false;
+	long long heldbytes = 0;
+
+	// An op of the path's own is queued or running
+	bool busy()
+	{
+		return !ops.empty() || running || firstEventId < lastEventId;
+	}
 
-	fileobj->lastEventId = eventIdNow;
+	bool quiescent()
+	{
+		return ops.empty() && !running && removers.empty() && pendingchildren.empty() && staged.empty() && firstEventId >= lastEventId;
+	}
 
-	auto worker = [defer, eventIdNow, fun]() {
-		if (options.verbose) fprintf(stderr, "Doing event ID %lld\n", eventIdNow);
-		int retval = fun(defer, eventIdNow);
-		if (options.verbose) fprintf(stderr, "Did event ID %lld with result %d (total retired: %lld)\n", eventIdNow, retval, (long long) retiredCount);
-		retiredCount++;
-		return retval;
-	};
+	void stage(const shared_ptr<cannyfs_pendingwrite>& write);
+	void unstage(cannyfs_pendingwrite* write);
+	// The staged payloads that overlap [offset, offset + size), oldest first
+	vector<shared_ptr<cannyfs_pendingwrite> > overlapping(off_t offset, size_t size);
+};
 
-	// TODO: NOT ALL EVENTS ARE RETIRED
-	//fprintf(stderr, "In flight %lld\n", eventIdNow - retiredCount);
+// The files held for packing. Each holds a pin for its entry here, besides the one for its queue runner.
+struct cannyfs_holds
+{
+	mutex lock;
+	set<cannyfs_filedata*> files;
+	atomic_llong held{ 0 };
+	atomic_llong packed{ 0 };
+	atomic_llong packedops{ 0 };
 
-	auto sleepUntilRetired = [&eventIdNow] () {
-		while (eventIdNow - retiredCount > options.maxinflight)
-		{
-			usleep(100);
-		}
-	};
+	void add(cannyfs_filedata* file)
+	{
+		lock_guard<mutex> _(lock);
+		files.insert(file);
+		held++;
+	}
 
-	if (!defer)
+	// True if the pin of file was ours to drop
+	bool forget(cannyfs_filedata* file)
 	{
-		lock.unlock();
-		sleepUntilRetired();
-		return worker();
+		lock_guard<mutex> _(lock);
+		return files.erase(file);
 	}
-	else
+
+	// Lets every held file go, when admission control runs out of room for their ops
+	void letgoall();
+
+	void report()
 	{
-		fileobj->ops.emplace(worker);
-		if (!fileobj->running)
-		{
-			// Hey, WE will make it running now.
-			fileobj->running = true;
-			lock.unlock();			
-			//workQueue.enqueue([fileobj] { fileobj->run(); });
-			thread([fileobj] { fileobj->run(); }).detach();
-		}
-		else
-		{
-			lock.unlock();
-		}
-		sleepUntilRetired();
+		if (!held) return;
 
-		return 0;
+		cerr << "[cannyfs] Held " << held << " created files until their release, packed " << packed << " of them into a single open, write and close covering "
+			<< packedops << " ops.\n";
 	}
-}
-
-template<class T, typename result_of<T(std::string)>::type = 0>
-int cannyfs_func_add_write(const char* funcname, bool defer, const std::string& path, T fun, bool dir = false)
+} holds;
+
+const uint8_t FILE_CREATED = 1;
+const uint8_t FILE_MISSING = 2;
+const uint8_t FILE_HASTRUESTAT = 4;
+// Some of our children have been evicted from the filemap, so we no longer know all the ones we created
+const uint8_t FILE_PARTIAL = 8;
+// Seen in a whole listing of the parent
+const uint8_t FILE_LISTED = 16;
+// A dir listed to the end, and no child forgotten since: a name that is neither listed nor created by us doesn't exist
+const uint8_t FILE_COMPLETE = 32;
+// A dir being listed from the start, which completes it unless a child is forgotten in the meantime
+const uint8_t FILE_LISTING = 64;
+
+// A rename or link from a path, queued on another path. The next op queued at the source waits for it, unless it is done
+// by then. Whichever of posting it and finishing the op happens last takes it down again.
+struct cannyfs_source
 {
-	if (options.verbose) fprintf(stderr, "Adding write %s (A) for %s\n", funcname, path.c_str());
-	return cannyfs_add_write_inner(defer, path, [path = string(path), fun, funcname, dir](bool deferred, long long eventId)->int {
-		cannyfs_writer writer(path, LOCK_WHOLE, eventId, dir);
-		return cannyfs_guarderror(deferred, funcname, path, fun(path));
-	});
-}
+	cannyfs_path path;
+	long long eventId = -1;
+	atomic_bool posted{ false };
+	atomic_bool done{ false };
 
-template<class T, typename result_of<T(std::string, fuse_file_info*)>::type = 0>
-int cannyfs_func_add_write(const char* funcname, bool defer, const std::string& path, fuse_file_info* origfi, T fun, bool dir = false)
-{
-	if (options.verbose) fprintf(stderr, "Adding write %s (B) for %s\n", funcname, path.c_str());
-	fuse_file_info fi = *origfi;
-	return cannyfs_add_write_inner(defer, path, [path = string(path), fun, fi, funcname, dir](bool deferred, long long eventId)->int {
-		cannyfs_writer writer(path, LOCK_WHOLE, eventId, dir);
-		return cannyfs_guarderror(deferred, funcname, path, fun(path, &fi));
-	});
-}
+	cannyfs_source(const cannyfs_path& path) : path(path)
+	{
+	}
+};
 
-template<class T, typename result_of<T(std::string, std::string)>::type = 0>
-int cannyfs_func_add_write(const char* funcname, bool defer, const std::string& path1, const std::string& path2, T fun, bool dir = false)
+struct cannyfs_filedata
 {
-	if (options.verbose) fprintf(stderr, "Adding write %s (C) for %s\n", funcname, path1.c_str());
-	return cannyfs_add_write_inner(defer, path2, [path1 = string(path1), path2 = string(path2), fun, funcname, dir](bool deferred, long long eventId)->int {
-		//cannyfs_writer writer1(path1, LOCK_WHOLE, eventId);
+	const cannyfs_path path;
 
-		// TODO: LOCKING MODEL MESSED UP
-		cannyfs_reader reader(path1, JUST_BARRIER, eventId);
-		ensure_parent(path1, eventId);
-		cannyfs_writer writer2(path2, LOCK_WHOLE, eventId, dir);
+	mutex datalock;
+	shared_ptr<cannyfs_opstate> opstate;
 
-		return cannyfs_guarderror(deferred, funcname, path1, fun(path1, path2));
-	});
-}
+	// Number of threads (or removers sets) currently holding a pointer to this entry.
+	// Only changed under the filemap shard lock, or by someone already holding a pin.
+	atomic_int pins{ 0 };
+	atomic<uint8_t> flags{ 0 };
+	atomic_llong lastused{ 0 };
 
-// Prepend the function name, for error reporting
-#define cannyfs_add_write(...) cannyfs_func_add_write(__func__, __VA_ARGS__)
+	cannyfs_stat stats;
+	std::atomic<off_t> size{ 0 };
+	// Every child of a dir made by us, so that it can be listed without asking the backend.
+	// Dropped when the dir is removed or moved. Guarded by datalock.
+	unique_ptr<set<string>> children;
+	// Every op on the path up to this event is done, so that a wait for one of them still returns once the
+	// op state is dropped, or even the entry. Guarded by datalock.
+	long long settled = ::eventId;
+	// Set while a rename or link from here is queued elsewhere, holding a pin. Guarded by datalock.
+	shared_ptr<cannyfs_source> source;
+
+	bool is(uint8_t flag)
+	{
+		return flags & flag;
+	}
 
-static int cannyfs_getattr(const char *path, struct stat *stbuf)
-{
-	if (options.verbose) fprintf(stderr, "Going to get attributes for %s\n", path);
+	void mark(uint8_t flag, bool on = true)
+	{
+		if (on)
+		{
+			flags |= flag;
+		}
+		else
+		{
+			flags &= ~flag;
+		}
+	}
 
-	const bool inaccurate = options.inaccuratestat;
-	cannyfs_reader b(path, inaccurate ? (NO_BARRIER | LOCK_WHOLE) : JUST_BARRIER);
+	// Call with datalock held
+	cannyfs_opstate& state()
+	{
+		if (!opstate)
+		{
+			opstate = make_shared<cannyfs_opstate>();
+			opstate->firstEventId = settled;
+		}
 
-	if (options.verbose && !b.fileobj)
+		return *opstate;
+	}
+
+	// Changes whenever an op is queued on the path, even one that is done by now. Call with datalock held.
+	long long lastevent()
 	{
-		fprintf(stderr, "File obj missing for getattr for %s\n", path);
+		return opstate ? max(settled, (long long) opstate->lastEventId) : settled;
 	}
 
-	if (inaccurate)
+	// Drop the op state once nothing is pending. Call with datalock held.
+	void trim()
 	{
-		if (options.cachemissing && b.fileobj && (bool) b.fileobj->missing)
+		if (opstate && opstate->quiescent())
 		{
-			if (options.verbose) fprintf(stderr, "Reporting %s to be missing\n", path);
-			return -ENOENT;
+			settled = max(settled, (long long) opstate->firstEventId);
+			opstate.reset();
 		}
+	}
 
-		bool hasstat = b.fileobj && (b.fileobj->created || b.fileobj->hastruestat);
-		if (hasstat)
+	void waitremove()
+	{
+		// TODO: Should really capture remover state at point of rmdir submission
+		// If same dirname is recreated and files removed from that one as well, bad things will happen
+		set<cannyfs_filedata*> toremove;
 		{
-			*stbuf = b.fileobj->stats;
-			update_maximum(b.fileobj->size, stbuf->st_size);
-			stbuf->st_size = b.fileobj->size;
-
-			return 0;
+			unique_lock<mutex> _(datalock);
+			if (!opstate) return;
+			toremove = opstate->removers;
 		}
-		b.lock.unlock();		
 
-		if (options.assumecreateddirempty)
+		for (auto filedata : toremove)
 		{
-			cannyfs_reader parentdata(bf::path(path).parent_path(), NO_BARRIER);
+			filedata->sync();
+		}
 
-			// If the parent dir was missing or is known not to exist, we can safely (?) assume that the subentry does not exist unless WE created it
-			if (parentdata.fileobj && (parentdata.fileobj->missing || parentdata.fileobj->created))
+		{
+			unique_lock<mutex> _(datalock);
+			// Highly inefficient
+			for (auto filedata : toremove)
 			{
-				return -ENOENT;
+				if (opstate && opstate->removers.erase(filedata))
+				{
+					filedata->pins--;
+				}
 			}
+			trim();
 		}
 	}
-	int res = lstat(path, stbuf);
-	update_maximum(b.fileobj->size, stbuf->st_size);
-	stbuf->st_size = b.fileobj->size;
 
-	if (res == -1)
+	// No one holds on to us and nothing is pending, so we can be dropped from the filemap
+	bool idle()
 	{
-		int err = errno;
-		if (options.cachemissing && err == ENOENT)
-		{
-			cannyfs_reader b2(path, NO_BARRIER);
-			b.fileobj->missing = true;
-		}
-		return -errno;
+		if (pins) return false;
+
+		unique_lock<mutex> data(datalock, try_to_lock);
+		if (!data) return false;
+
+		trim();
+		return !opstate;
 	}
 
-	return 0;
-}
+	// We know something about the path that the backend would otherwise have to tell us
+	bool cached()
+	{
+		return flags & (FILE_CREATED | FILE_MISSING | FILE_HASTRUESTAT | FILE_LISTED);
+	}
 
-static int cannyfs_fgetattr(const char *path, struct stat *stbuf,
-			struct fuse_file_info *fi)
-{
-	if (options.inaccuratestat)
+	cannyfs_filedata(const cannyfs_path& name) : path(name)
 	{
-		return cannyfs_getattr(path, stbuf);
 	}
-	cannyfs_reader b(path, JUST_BARRIER);
 
-	int res;
+	// False if an op was handed to the backend, which then resumes the queue
+	bool run();
+	// Hands the queue to a worker. Call with datalock held, and a pin taken for the runner.
+	void start();
+	// Starts the queue if it is held for packing. Call with datalock held.
+	void letgo();
+	size_t chainable(cannyfs_opstate& state);
+	bool packable(cannyfs_opstate& state, size_t length);
+	void coalesce(cannyfs_opstate& state, cannyfs_pendingwrite& first);
 
-	(void) path;
+	// Spin 'til all our events have been handled, or at least up to the passed ID
+	void spinevent(unique_lock<mutex>& locallock, long long targetEvent = numeric_limits<long long>::max())
+	{
+		shared_ptr<cannyfs_opstate> state = opstate;
+		if (!state) return;
 
-	res = fstat(getfh(fi), stbuf);
-	if (res == -1)
-		return -errno;
+		letgo();
+		long long eventId = min((long long) state->lastEventId, targetEvent);
+		if (state->firstEventId < eventId)
+		{
+			cannyfs_blocked blocked;
+			while (state->firstEventId < eventId)
+			{
+				state->processed.wait(locallock);
+			}
+		}
+	}
 
-	return 0;
-}
+	void sync()
+	{
+		unique_lock<mutex> locallock(datalock);
+		spinevent(locallock);
+	}
+};
 
-static int cannyfs_access(const char *path, int mask)
+struct cannyfs_filehandle
+{
+	mutex lock;
+	int64_t fd;
+	condition_variable opened;
+	// Set when a rename was folded into the queued create of the handle, which then makes the file here instead.
+	// The ops of its new parent dir up to movedafter have to run first.
+	unique_ptr<cannyfs_path> movedto;
+	long long movedafter = -1;
+
+	cannyfs_filehandle() : fd(-1)
+	{
+	}
+
+	~cannyfs_filehandle()
+	{
+		// We might want to report the error up
+		/*if (fd != -1)
+		{
+			close(fd);
+		}*/
+	}
+
+	void setfh(uint64_t fd)
+	{
+		lock_guard<mutex> locallock(lock);
+		this->fd = fd;
+		opened.notify_all();
+	}
+
+	uint64_t getfh()
+	{
+		unique_lock<mutex> locallock(lock);
+		if (fd == -1)
+		{
+			cannyfs_blocked blocked;
+			while (fd == -1)
+			{
+				opened.wait(locallock);
+			}
+		}
+
+		return fd;
+	}
+};
+
+typedef concurrent_vector<cannyfs_filehandle> fhstype;
+fhstype fhs;
+boost::lockfree::stack<fhstype::iterator> freefhs(16);
+concurrent_vector<string> errors;
+
+typedef pair<int, int> cannyfs_pipefds;
+
+namespace boost
+{
+template <class T, class U> struct has_trivial_assign<std::pair<T,U> > :
+	integral_constant<bool,
+	(has_trivial_assign<T>::value &&
+	has_trivial_assign<U>::value)> { };
+}
+
+const cannyfs_pipefds NO_PIPE(-1, -1);
+
+// Pool of pipes for staging write_buf payloads, sized to hold a full max_write request.
+// The total pipe memory is capped by --maxpipebytes. Beyond that, or if no pipe can be created,
+// NO_PIPE is handed out and the payload is staged in user space instead.
+struct cannyfs_pipes
+{
+private:
+	boost::lockfree::stack<cannyfs_pipefds> freepipes;
+	atomic_int pipesize{ 0 };
+	atomic_llong totalbytes{ 0 };
+public:
+	atomic_llong hits{ 0 };
+	atomic_llong misses{ 0 };
+	atomic_llong fallbacks{ 0 };
+	atomic_llong peakbytes{ 0 };
+
+	cannyfs_pipes() : freepipes(100)
+	{}
+
+	// Size new pipes for requests of up to size bytes, 0 for the kernel default
+	void setsize(int size)
+	{
+		pipesize = size;
+	}
+
+	cannyfs_pipefds getpipe()
+	{
+		cannyfs_pipefds pipe;
+		if (freepipes.pop(pipe))
+		{
+			hits++;
+			return pipe;
+		}
+
+		long long expected = max((int) pipesize, 65536);
+		if (options.maxpipebytes > 0 && totalbytes + expected > options.maxpipebytes)
+		{
+			fallbacks++;
+			return NO_PIPE;
+		}
+
+		if (::pipe(&pipe.first) == -1)
+		{
+			if (options.verbose) fprintf(stderr, "Unable to get pipe, errno %d.\n", errno);
+			fallbacks++;
+			return NO_PIPE;
+		}
+		misses++;
+
+		if (pipesize)
+		{
+			// Might fail beyond /proc/sys/fs/pipe-max-size, then we just live with the default
+			fcntl(pipe.second, F_SETPIPE_SZ, (int) pipesize);
+		}
+		// write_buf never waits for a full pipe, it spills into the staging arena instead
+		fcntl(pipe.second, F_SETFL, O_NONBLOCK);
+
+		long long nowbytes = totalbytes += fcntl(pipe.second, F_GETPIPE_SZ);
+		long long prev = peakbytes;
+		while (prev < nowbytes && !peakbytes.compare_exchange_weak(prev, nowbytes));
+
+		return pipe;
+	}
+
+	void returnpipe(cannyfs_pipefds pipe)
+	{
+		if (pipe == NO_PIPE) return;
+
+		if (!freepipes.bounded_push(pipe))
+		{
+			closepipe(pipe);
+		}
+	}
+
+	// Close a pipe that can't be reused, e.g. with data of a failed write left in it
+	void closepipe(cannyfs_pipefds pipe)
+	{
+		if (pipe == NO_PIPE) return;
+
+		totalbytes -= fcntl(pipe.second, F_GETPIPE_SZ);
+		close(pipe.first);
+		close(pipe.second);
+	}
+
+	void report()
+	{
+		cerr << "[cannyfs] Pipe pool: " << hits << " hits, " << misses << " new pipes, " << fallbacks
+			<< " fallbacks to user space, peak " << (peakbytes >> 10) << " KiB of pipes.\n";
+	}
+} piper;
+
+// Pooled user space buffers for write_buf payloads that don't fit in their pipe.
+// Buffers are rounded up to power-of-two size classes, anything above the largest class is not pooled.
+struct cannyfs_arena
+{
+private:
+	static const int MINSHIFT = 12;
+	static const int MAXSHIFT = 20;
+	static const size_t MAXPOOLED = 64;
+
+	struct sizeclass
+	{
+		mutex lock;
+		vector<char*> free;
+	};
+	sizeclass classes[MAXSHIFT - MINSHIFT + 1];
+
+	static int classof(size_t size)
+	{
+		int shift = MINSHIFT;
+		while (shift <= MAXSHIFT && ((size_t) 1 << shift) < size) shift++;
+		return shift > MAXSHIFT ? -1 : shift - MINSHIFT;
+	}
+
+public:
+	atomic_llong allocated{ 0 };
+	atomic_llong reused{ 0 };
+	atomic_llong spilledbytes{ 0 };
+
+	char* get(size_t size)
+	{
+		spilledbytes += size;
+		int index = classof(size);
+		if (index >= 0)
+		{
+			sizeclass& c = classes[index];
+			lock_guard<mutex> _(c.lock);
+			if (!c.free.empty())
+			{
+				char* buf = c.free.back();
+				c.free.pop_back();
+				reused++;
+				return buf;
+			}
+		}
+
+		allocated++;
+		return new char[index >= 0 ? (size_t) 1 << (index + MINSHIFT) : size];
+	}
+
+	void put(char* buf, size_t size)
+	{
+		int index = classof(size);
+		if (index >= 0)
+		{
+			sizeclass& c = classes[index];
+			lock_guard<mutex> _(c.lock);
+			if (c.free.size() < MAXPOOLED)
+			{
+				c.free.push_back(buf);
+				return;
+			}
+		}
+
+		delete[] buf;
+	}
+
+	void report()
+	{
+		cerr << "[cannyfs] Staging arena: " << (spilledbytes >> 10) << " KiB spilled from pipes, "
+			<< allocated << " buffers allocated, " << reused << " reused.\n";
+	}
+} arena;
+
+// Data staged by write_buf until the op runs. The first piped bytes wait in the pipe,
+// whatever did not fit there without blocking is kept in an arena buffer.
+struct cannyfs_pendingwrite
+{
+	uint64_t fh;
+	off_t offset;
+	int size;
+	cannyfs_pipefds pipe;
+	int piped = 0;
+	char* spill = nullptr;
+	// Written out as part of an earlier op in the same queue
+	bool absorbed = false;
+	vector<shared_ptr<cannyfs_pendingwrite> > merged;
+	long long eventId = 0;
+
+	// The whole payload has been staged, successfully or not
+	atomic_bool staged{ false };
+	bool failed = false;
+	// Handed to the backend write, so reads can no longer be served from it
+	bool consumed = false;
+	mutex lock;
+	condition_variable ready;
+
+	cannyfs_pendingwrite(uint64_t fh, off_t offset, int size, cannyfs_pipefds pipe) :
+		fh(fh), offset(offset), size(size), pipe(pipe)
+	{
+	}
+
+	~cannyfs_pendingwrite()
+	{
+		if (spill)
+		{
+			arena.put(spill, size - piped);
+		}
+	}
+
+	void setstaged(bool success)
+	{
+		lock_guard<mutex> _(lock);
+		failed = !success;
+		staged = true;
+		ready.notify_all();
+	}
+
+	// Returns false if the payload could not be staged
+	bool waitstaged()
+	{
+		unique_lock<mutex> locallock(lock);
+		if (!staged)
+		{
+			cannyfs_blocked blocked;
+			while (!staged)
+			{
+				ready.wait(locallock);
+			}
+		}
+
+		return !failed;
+	}
+
+	// Returns false if the payload could not be staged
+	bool consume()
+	{
+		if (!waitstaged())
+		{
+			return false;
+		}
+
+		lock_guard<mutex> _(lock);
+		consumed = true;
+		return true;
+	}
+
+	// Copy len bytes of the payload, starting at from, to dst. False once it has been handed to the backend.
+	// The pipe can't be read without draining it, so its part of the payload is moved to memory first.
+	bool peek(char* dst, int from, int len)
+	{
+		if (!waitstaged())
+		{
+			return false;
+		}
+
+		lock_guard<mutex> _(lock);
+		if (consumed)
+		{
+			return false;
+		}
+
+		if (piped)
+		{
+			char* copy = arena.get(size);
+			int val = 0;
+			while (val < piped)
+			{
+				int ret = read(pipe.first, copy + val, piped - val);
+				if (ret <= 0)
+				{
+					if (ret < 0 && errno == EINTR) continue;
+					// Partly drained, the backend write can't be made either
+					arena.put(copy, size);
+					failed = true;
+					return false;
+				}
+				val += ret;
+			}
+			if (spill)
+			{
+				memcpy(copy + piped, spill, size - piped);
+				arena.put(spill, size - piped);
+			}
+			piper.returnpipe(pipe);
+			pipe = NO_PIPE;
+			piped = 0;
+			spill = copy;
+		}
+		memcpy(dst, spill + from, len);
+
+		return true;
+	}
+};
+
+// The payload of a vectored write, which must outlive the write when the backend makes it later
+struct cannyfs_writepayload
+{
+	shared_ptr<cannyfs_pendingwrite> write;
+	// The piped parts, copied out. Spilled ones are written straight from the arena.
+	vector<unique_ptr<char[]> > data;
+	vector<iovec> iov;
+};
+
+void cannyfs_opstate::stage(const shared_ptr<cannyfs_pendingwrite>& write)
+{
+	staged.emplace(write->offset, write);
+	maxstaged = max(maxstaged, write->size);
+}
+
+void cannyfs_opstate::unstage(cannyfs_pendingwrite* write)
+{
+	auto range = staged.equal_range(write->offset);
+	for (auto i = range.first; i != range.second; ++i)
+	{
+		if (i->second.get() == write)
+		{
+			staged.erase(i);
+			break;
+		}
+	}
+	if (staged.empty())
+	{
+		maxstaged = 0;
+	}
+}
+
+vector<shared_ptr<cannyfs_pendingwrite> > cannyfs_opstate::overlapping(off_t offset, size_t size)
+{
+	vector<shared_ptr<cannyfs_pendingwrite> > result;
+	const off_t end = offset + size;
+	for (auto i = staged.lower_bound(offset - maxstaged); i != staged.end() && i->first < end; ++i)
+	{
+		if (i->first + i->second->size > offset)
+		{
+			result.push_back(i->second);
+		}
+	}
+	sort(result.begin(), result.end(), [](const shared_ptr<cannyfs_pendingwrite>& a, const shared_ptr<cannyfs_pendingwrite>& b)
+	{
+		return a->eventId < b->eventId;
+	});
+
+	return result;
+}
+
+// Stage the payload of buf into write, which has a freshly taken (empty) pipe
+int cannyfs_stagewrite(cannyfs_pendingwrite& write, fuse_bufvec* buf)
+{
+	struct fuse_bufvec halfdst = FUSE_BUFVEC_INIT((size_t) write.size);
+
+	halfdst.buf[0].flags = FUSE_BUF_IS_FD;
+	halfdst.buf[0].fd = write.pipe.second;
+
+	while (write.pipe != NO_PIPE && write.piped < write.size)
+	{
+		int ret = fuse_buf_copy(&halfdst, buf, (fuse_buf_copy_flags)0);
+		if (ret == -EAGAIN || ret == 0)
+		{
+			break;
+		}
+		if (ret < 0)
+		{
+			return ret;
+		}
+
+		write.piped += ret;
+	}
+
+	int remaining = write.size - write.piped;
+	if (remaining)
+	{
+		write.spill = arena.get(remaining);
+		struct fuse_bufvec memdst = FUSE_BUFVEC_INIT((size_t) remaining);
+		memdst.buf[0].mem = write.spill;
+
+		int val = 0;
+		while (val < remaining)
+		{
+			int ret = fuse_buf_copy(&memdst, buf, (fuse_buf_copy_flags)0);
+			if (ret <= 0)
+			{
+				return ret < 0 ? ret : -EIO;
+			}
+			val += ret;
+		}
+	}
+
+	return write.size;
+}
+
+const size_t MAX_COALESCED_BYTES = 4 << 20;
+
+struct cannyfs_writestats
+{
+	atomic_llong coalescedwrites{ 0 };
+	atomic_llong coalescedops{ 0 };
+
+	void report()
+	{
+		cerr << "[cannyfs] Write coalescing: " << coalescedwrites << " vectored writes covering "
+			<< coalescedops << " write_buf ops.\n";
+	}
+} writestats;
+
+fhstype::iterator getnewfh()
+{
+	fhstype::iterator toreturn;
+	if (freefhs.pop(toreturn))
+	{
+		return toreturn;
+	}
+	return fhs.grow_by(1);
+}
+
+cannyfs_filehandle* getcfh(int fd)
+{
+	return &fhs[fd];
+}
+
+uint64_t getfh(const fuse_file_info* fi)
+{
+	return getcfh(fi->fh)->getfh();
+}
+
+int cannyfs_guarderror(bool defer, const char* funcname, const std::string& path, int res)
+{
+	if (defer && res < 0)
+	{
+		stringstream error;
+		error << "ERROR: " << funcname << " for " << path;
+		cerr << error.str() << "\n";
+		if (options.dieonerror)
+		{
+			abort();
+		}
+		errors.push_back(error.str());
+	}
+
+	return res;
+}
+
+struct cannyfs_closer
+{
+private:
+	int fd;
+public:
+	cannyfs_closer() = delete;
+	cannyfs_closer(int fd) : fd(fd) {}
+	~cannyfs_closer()
+	{
+		cannyfs_guarderror(true, "cannyfs_closer", "<path not known at this point>", close(fd));
+	}
+};
+
+const int NO_BARRIER = 1;
+const int JUST_BARRIER = 0;
+const int LOCK_WHOLE = 2;
+const int DIR_LOCK = 4;
+
+vector<cannyfs_closer> closes;
+
+struct cannyfs_filemap
+{
+private:
+	static const int SHARDS = 64;
+
+	static const size_t SWEEP_MIN = 1024;
+
+	struct shard
+	{
+		// Entries are never moved, the rest of the code holds on to (pinned) cannyfs_filedata pointers
+		unordered_multimap<size_t, unique_ptr<cannyfs_filedata>, cannyfs_identityhash> data;
+		shared_timed_mutex lock;
+		atomic_llong usetick{ 0 };
+		size_t inserted = 0;
+
+		bool needsweep(size_t cap)
+		{
+			if (cap && data.size() > cap)
+			{
+				return inserted >= max<size_t>(cap / 10, 1);
+			}
+			return inserted >= max((size_t) SWEEP_MIN, data.size() / 2);
+		}
+
+		cannyfs_filedata* find(size_t hash, const cannyfs_path& path)
+		{
+			auto range = data.equal_range(hash);
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				if (i->second->path == path)
+				{
+					return i->second.get();
+				}
+			}
+
+			return nullptr;
+		}
+	};
+
+	shard shards[SHARDS];
+
+	// Tell the parent directory that it no longer knows all of its children. We already hold the
+	// lock of held exclusively, so rather than waiting for the lock of another shard, we give up.
+	bool forgetchild(const cannyfs_path& path, shard& held)
+	{
+		cannyfs_path parent = path.parent();
+		size_t hash = parent.hash();
+		shard& s = shards[hash % SHARDS];
+		shared_lock<shared_timed_mutex> maplock(s.lock, defer_lock);
+		if (&s != &held && !maplock.try_lock())
+		{
+			return false;
+		}
+
+		cannyfs_filedata* parentdata = s.find(hash, parent);
+		if (parentdata)
+		{
+			parentdata->mark(FILE_PARTIAL);
+			parentdata->mark(FILE_COMPLETE | FILE_LISTING, false);
+		}
+
+		return true;
+	}
+
+	// Drop idle entries. Those without any cached state always go, the others are evicted in LRU
+	// order when the shard holds more than cap entries. Call with the shard lock held exclusively.
+	void sweep(shard& s, size_t cap)
+	{
+		typedef decltype(s.data.begin()) entry;
+		vector<entry> evictable;
+		for (auto i = s.data.begin(); i != s.data.end();)
+		{
+			cannyfs_filedata* filedata = i->second.get();
+			if (filedata->idle())
+			{
+				if (!filedata->cached())
+				{
+					i = s.data.erase(i);
+					reclaimed++;
+					continue;
+				}
+				evictable.push_back(i);
+			}
+			++i;
+		}
+
+		if (cap && s.data.size() > cap)
+		{
+			size_t toevict = s.data.size() - cap * 9 / 10;
+			sort(evictable.begin(), evictable.end(), [](const entry& a, const entry& b)
+			{
+				return a->second->lastused < b->second->lastused;
+			});
+			for (auto i : evictable)
+			{
+				if (!toevict) break;
+				if (forgetchild(i->second->path, s))
+				{
+					s.data.erase(i);
+					evicted++;
+					toevict--;
+				}
+			}
+		}
+		s.inserted = 0;
+	}
+
+	size_t shardcap()
+	{
+		return options.maxtrackedpaths > 0 ? max(options.maxtrackedpaths / SHARDS, 1) : 0;
+	}
+
+public:
+	atomic_bool syncnow = { false };
+	atomic_llong reclaimed{ 0 };
+	atomic_llong evicted{ 0 };
+	atomic_llong completemisses{ 0 };
+
+	// All entries, pinned. Pass each to release when done.
+	vector<cannyfs_filedata*> shallowcopy()
+	{
+		vector<cannyfs_filedata*> res;
+		for (auto& s : shards)
+		{
+			shared_lock<shared_timed_mutex> maplock(s.lock);
+			res.reserve(res.size() + s.data.size());
+			for (auto& filedata : s.data)
+			{
+				filedata.second->pins++;
+				res.push_back(filedata.second.get());
+			}
+		}
+
+		return res;
+	}
+
+	size_t size()
+	{
+		size_t total = 0;
+		for (auto& s : shards)
+		{
+			shared_lock<shared_timed_mutex> maplock(s.lock);
+			total += s.data.size();
+		}
+
+		return total;
+	}
+
+	void release(cannyfs_filedata* filedata)
+	{
+		filedata->pins--;
+	}
+
+	void syncall(bool silent = false)
+	{
+		for (auto filedata : shallowcopy())
+		{
+			filedata->sync();
+			release(filedata);
+		}
+		if (!silent) cerr << "[cannyfs] Global file sync completed." << std::endl;
+	}
+
+	// Approximate memory use of a tracked path, including map node and any op state
+	double bytesperentry()
+	{
+		size_t entries = 0;
+		size_t bytes = 0;
+		for (auto& s : shards)
+		{
+			shared_lock<shared_timed_mutex> maplock(s.lock);
+			bytes += s.data.bucket_count() * sizeof(void*);
+			for (auto& entry : s.data)
+			{
+				cannyfs_filedata* filedata = entry.second.get();
+				entries++;
+				bytes += sizeof(entry) + 2 * sizeof(void*) + sizeof(cannyfs_filedata) + sizeof(cannyfs_pathnode);
+				if (filedata->path.str().capacity() > 15)
+				{
+					bytes += filedata->path.str().capacity() + 1;
+				}
+
+				unique_lock<mutex> _(filedata->datalock);
+				if (filedata->opstate)
+				{
+					bytes += sizeof(cannyfs_opstate) + 2 * sizeof(void*);
+				}
+				if (filedata->children)
+				{
+					bytes += sizeof(set<string>) + filedata->children->size() * (sizeof(string) + 4 * sizeof(void*));
+				}
+			}
+		}
+
+		return entries ? (double) bytes / entries : 0;
+	}
+
+	void report()
+	{
+		cerr << "[cannyfs] Filemap: " << size() << " paths tracked, ~" << (long long) bytesperentry() << " bytes per entry, "
+			<< reclaimed << " idle entries reclaimed, " << evicted << " evicted, " << completemisses << " misses answered from complete dirs.\n";
+	}
+
+	void pollsync()
+	{
+		bool now = false;
+		now = syncnow.exchange(now);
+		if (now)
+		{
+			cerr << "[cannyfs] Initializing global file sync." << std::endl;
+		}
+	}
+
+	// The entry returned is pinned, pass it to release when done. It is returned with datalock held.
+	cannyfs_filedata* get(const cannyfs_path& path, bool always, unique_lock<mutex>& lock)
+	{
+		cannyfs_filedata* result = nullptr;
+		auto locktransferline = [&] { lock = unique_lock<mutex>(result->datalock); };
+
+		size_t hash = path.hash();
+		shard& s = shards[hash % SHARDS];
+		{
+			shared_lock<shared_timed_mutex> maplock(s.lock);
+			result = s.find(hash, path);
+			if (result)
+			{
+				result->pins++;
+				result->lastused = ++s.usetick;
+				maplock.unlock();
+				locktransferline();
+			}
+		}
+
+		if (always && !result)
+		{
+			unique_lock<shared_timed_mutex> maplock(s.lock);
+			result = s.find(hash, path);
+			if (!result)
+			{
+				result = new cannyfs_filedata(path);
+				s.data.emplace(hash, unique_ptr<cannyfs_filedata>(result));
+				s.inserted++;
+			}
+			result->pins++;
+			result->lastused = ++s.usetick;
+
+			size_t cap = shardcap();
+			if (s.needsweep(cap))
+			{
+				sweep(s, cap);
+			}
+			maplock.unlock();
+			locktransferline();
+		}
+
+		return result;
+	}
+} filemap;
+
+struct cannyfs_reader
+{
+public:
+	unique_lock<mutex> lock;
+	cannyfs_filedata* fileobj;
+	cannyfs_reader(const cannyfs_path& path, int flag, long long targetEvent = numeric_limits<long long>::max())
+	{
+		if (options.verbose) fprintf(stderr, "Waiting for reading %s, with flags %d\n", path.c_str(), flag);
+
+		unique_lock<mutex> locallock;
+		fileobj = filemap.get(path, flag & LOCK_WHOLE, locallock);
+
+		if (!(flag & NO_BARRIER) && fileobj)
+		{
+			fileobj->spinevent(locallock, targetEvent);
+		}
+
+		if (flag & LOCK_WHOLE)
+		{
+			swap(lock, locallock);
+		}
+
+		if (options.verbose) fprintf(stderr, "Got reader lock %s\n", path.c_str());
+	}
+
+	~cannyfs_reader()
+	{
+		if (lock.owns_lock())
+		{
+			lock.unlock();
+		}
+		if (fileobj)
+		{
+			filemap.release(fileobj);
+		}
+	}
+};
+
+// Snippet from http://stackoverflow.com/questions/16190078/how-to-atomically-update-a-maximum-value
+template<typename T>
+void update_maximum(std::atomic<T>& maximum_value, T const& value) noexcept
+{
+	T prev_value = maximum_value;
+	while (prev_value < value &&
+		!maximum_value.compare_exchange_weak(prev_value, value))
+		;
+}
+
+struct cannyfs_dirreader : cannyfs_reader
+{
+private:
+public:
+	cannyfs_dirreader() = delete;
+	cannyfs_dirreader(const cannyfs_path& path, int flag) :
+		cannyfs_reader(path, flag)
+	{
+	}
+};
+
+// Ensure that the parent directory exists, no-op unless eagermkdir is on
+void ensure_parent(const cannyfs_path& path, long long targetEvent = numeric_limits<long long>::max())
+{
+	if (options.eagermkdir)
+	{
+		// If we create dirs willy-nilly, we need to wait before we do stuff to entries within those dirs
+		cannyfs_reader parentdir(path.parent(), JUST_BARRIER, targetEvent);
+	}
+}
+
+// Keep the listing of a dir made by us in step with a child coming or going
+void cannyfs_dirchild(const cannyfs_path& path, bool present)
+{
+	unique_lock<mutex> lock;
+	cannyfs_filedata* parent = filemap.get(path.parent(), false, lock);
+	if (!parent) return;
+
+	if (parent->children)
+	{
+		if (present)
+		{
+			parent->children->insert(path.name());
+		}
+		else
+		{
+			parent->children->erase(path.name());
+		}
+	}
+	lock.unlock();
+	filemap.release(parent);
+}
+
+// A child that an op has yet to create on the backend, listed from the parent's pending children
+// until then. Call with delta 1 before queueing the op, and with -1 once it has run.
+void cannyfs_pendingchild(const cannyfs_path& path, int delta)
+{
+	if (!options.overlaydirs) return;
+
+	unique_lock<mutex> lock;
+	cannyfs_filedata* parent = filemap.get(path.parent(), delta > 0, lock);
+	if (!parent) return;
+
+	// A dir made by us is listed from its children anyway
+	if (!parent->children && (delta > 0 || parent->opstate))
+	{
+		map<string, int>& pending = parent->state().pendingchildren;
+		auto i = pending.emplace(path.name(), 0).first;
+		i->second += delta;
+		if (i->second <= 0)
+		{
+			pending.erase(i);
+		}
+		parent->trim();
+	}
+	lock.unlock();
+	filemap.release(parent);
+}
+
+struct cannyfs_writer
+{
+private:
+	unique_lock<mutex> lock;
+	cannyfs_filedata* fileobj;
+	shared_ptr<cannyfs_opstate> opstate;
+	long long eventId;
+	bool global;
+public:
+	cannyfs_writer(const cannyfs_path& path, int flag, long long eventId, bool dir = false) : eventId(eventId), global(path.empty())
+	{
+		ensure_parent(path, eventId);
+
+		if (options.verbose) fprintf(stderr, "Entering write lock for %s\n", path.c_str());
+		{
+			unique_lock<mutex> datalocked;
+			fileobj = filemap.get(path, true, datalocked);
+			fileobj->state();
+			opstate = fileobj->opstate;
+		}
+		lock = unique_lock<mutex>(opstate->oplock);
+
+		if (flag != LOCK_WHOLE)
+		{
+			if (options.verbose) fprintf(stderr, "Leaving write lock early for %s\n", path.c_str());
+			lock.unlock();
+		}
+
+		if (dir)
+		{
+			// Removers are considered all fatally directory-altering events. unlink is always one.
+			fileobj->waitremove();
+		}
+
+		if (!global && options.restrictivedirs)
+		{
+			if (dir)
+			{
+				// We are a dir
+				cannyfs_dirreader(path, JUST_BARRIER);
+			}
+			unique_lock<mutex> globallock;
+			cannyfs_filedata* globalfileobj = filemap.get("", true, globallock);
+			update_maximum(globalfileobj->state().lastEventId, eventId);
+			globallock.unlock();
+			filemap.release(globalfileobj);
+		}
+	}
+
+	// For ops that finish on another thread
+	void unlockop()
+	{
+		if (lock.owns_lock())
+		{
+			lock.unlock();
+		}
+	}
+
+	~cannyfs_writer()
+	{
+		unique_lock<mutex> endlock(fileobj->datalock);
+		update_maximum(opstate->firstEventId, eventId);
+		opstate->processed.notify_all();
+
+		if (!global && options.restrictivedirs)
+		{
+			cannyfs_writer("", JUST_BARRIER, eventId);
+		}
+		if (options.verbose) fprintf(stderr, "Leaving write lock for %s\n", fileobj->path.c_str());
+
+		fileobj->trim();
+		endlock.unlock();
+		if (lock.owns_lock())
+		{
+			lock.unlock();
+		}
+		filemap.release(fileobj);
+	}
+};
+
+// An open directory, closed once it has left the cache and the last syscall using it is done
+struct cannyfs_dirfd
+{
+	const int fd;
+
+	explicit cannyfs_dirfd(int fd) : fd(fd)
+	{
+	}
+
+	~cannyfs_dirfd()
+	{
+		close(fd);
+	}
+};
+
+// LRU cache of directory fds by path. Backend syscalls go through the *at() variants relative to
+// the fd of the parent, so that the kernel only resolves the last component instead of the whole path.
+struct cannyfs_dirfds
+{
+private:
+	struct entry
+	{
+		cannyfs_path path;
+		shared_ptr<cannyfs_dirfd> dir;
+	};
+
+	mutex lock;
+	// Bumped by every forget(), so that a dir opened across one is not cached. Guarded by lock.
+	unsigned long long generation = 0;
+	// Most recently used first
+	list<entry> lru;
+	unordered_multimap<size_t, list<entry>::iterator, cannyfs_identityhash> index;
+
+	list<entry>::iterator find(const cannyfs_path& path)
+	{
+		auto range = index.equal_range(path.hash());
+		for (auto i = range.first; i != range.second; ++i)
+		{
+			if (i->second->path == path)
+			{
+				return i->second;
+			}
+		}
+
+		return lru.end();
+	}
+
+	void erase(list<entry>::iterator i)
+	{
+		auto range = index.equal_range(i->path.hash());
+		for (auto j = range.first; j != range.second; ++j)
+		{
+			if (j->second == i)
+			{
+				index.erase(j);
+				break;
+			}
+		}
+		lru.erase(i);
+	}
+
+	shared_ptr<cannyfs_dirfd> get(const cannyfs_path& dir)
+	{
+		unsigned long long opengeneration;
+		{
+			lock_guard<mutex> _(lock);
+			auto i = find(dir);
+			if (i != lru.end())
+			{
+				hits++;
+				lru.splice(lru.begin(), lru, i);
+				return i->dir;
+			}
+			opengeneration = generation;
+		}
+
+		misses++;
+		while (true)
+		{
+			int fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1)
+			{
+				return nullptr;
+			}
+			auto opened = make_shared<cannyfs_dirfd>(fd);
+
+			lock_guard<mutex> _(lock);
+			if (generation != opengeneration)
+			{
+				// A dir moved or went away while we opened this one, which might be it. Open it again under its
+				// current name.
+				opengeneration = generation;
+				continue;
+			}
+			auto i = find(dir);
+			if (i != lru.end())
+			{
+				return i->dir;
+			}
+			lru.push_front({ dir, opened });
+			index.emplace(dir.hash(), lru.begin());
+			while (lru.size() > (size_t) options.maxdirfds)
+			{
+				erase(prev(lru.end()));
+				evicted++;
+			}
+
+			return opened;
+		}
+	}
+
+public:
+	atomic_llong hits{ 0 };
+	atomic_llong misses{ 0 };
+	atomic_llong evicted{ 0 };
+	atomic_llong invalidated{ 0 };
+
+	// Splits path into the fd of its directory and the name within it. name points into path.
+	// Gives AT_FDCWD and the whole path if the directory can't be had from the cache.
+	shared_ptr<cannyfs_dirfd> at(const cannyfs_path& path, int& dirfd, const char*& name)
+	{
+		dirfd = AT_FDCWD;
+		name = path.c_str();
+		if (options.maxdirfds <= 0)
+		{
+			return nullptr;
+		}
+
+		const char* slash = strrchr(name, '/');
+		if (!slash || !slash[1])
+		{
+			return nullptr;
+		}
+
+		shared_ptr<cannyfs_dirfd> dir = get(path.parent());
+		if (dir)
+		{
+			dirfd = dir->fd;
+			name = slash + 1;
+		}
+
+		return dir;
+	}
+
+	// Drops path and everything below it, for when a directory goes away or moves
+	void forget(const cannyfs_path& path)
+	{
+		const string& prefix = path.str();
+		lock_guard<mutex> _(lock);
+		generation++;
+		for (auto i = lru.begin(); i != lru.end();)
+		{
+			const string& cached = i->path.str();
+			bool below = cached.size() > prefix.size() && !cached.compare(0, prefix.size(), prefix) &&
+				(prefix.back() == '/' || cached[prefix.size()] == '/');
+			if (i->path == path || below)
+			{
+				erase(i++);
+				invalidated++;
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	void report()
+	{
+		long long lookups = hits + misses;
+		if (!lookups) return;
+
+		cerr << "[cannyfs] Directory fds: " << hits << " hits, " << misses << " misses (" << (100 * hits / lookups) << "% hit rate), "
+			<< evicted << " evicted, " << invalidated << " invalidated.\n";
+	}
+} dirfds;
+
+// Backend syscall of a deferred op, described so that the backend decides how to make it.
+// Path pointers must stay valid until the op completes, the op keeps its paths alive for that.
+// then() gets the raw result (-errno on failure) and gives the op's result.
+struct cannyfs_syscall
+{
+	uint8_t opcode = IORING_OP_NOP;
+	int fd = -1;
+	int flags = 0;
+	mode_t mode = 0;
+	// Relative to dirfd and dirfd2, which dirs keeps open
+	const char* path = nullptr;
+	const char* path2 = nullptr;
+	int dirfd = AT_FDCWD;
+	int dirfd2 = AT_FDCWD;
+	shared_ptr<cannyfs_dirfd> dirs[2];
+	string target;
+	off_t offset = 0;
+	shared_ptr<cannyfs_writepayload> payload;
+	// A direct descriptor in the ring's file table, opened, written or closed instead of fd
+	int slot = -1;
+	function<int(int)> then;
+
+	// The paths must outlive the syscall
+	void at(const cannyfs_path& path)
+	{
+		dirs[0] = dirfds.at(path, dirfd, this->path);
+	}
+
+	void at2(const cannyfs_path& path)
+	{
+		dirs[1] = dirfds.at(path, dirfd2, path2);
+	}
+
+	static cannyfs_syscall open(const cannyfs_path& path, int flags, mode_t mode)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_OPENAT;
+		call.at(path);
+		call.flags = flags;
+		call.mode = mode;
+		return call;
+	}
+
+	static cannyfs_syscall close(int fd)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_CLOSE;
+		call.fd = fd;
+		return call;
+	}
+
+	static cannyfs_syscall mkdir(const cannyfs_path& path, mode_t mode)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_MKDIRAT;
+		call.at(path);
+		call.mode = mode;
+		return call;
+	}
+
+	static cannyfs_syscall unlink(const cannyfs_path& path, int flags)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_UNLINKAT;
+		call.at(path);
+		call.flags = flags;
+		return call;
+	}
+
+	static cannyfs_syscall rename(const cannyfs_path& from, const cannyfs_path& to, int flags)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_RENAMEAT;
+		call.at(from);
+		call.at2(to);
+		call.flags = flags;
+		return call;
+	}
+
+	static cannyfs_syscall symlink(const string& target, const cannyfs_path& path)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_SYMLINKAT;
+		call.target = target;
+		call.at(path);
+		return call;
+	}
+
+	static cannyfs_syscall link(const cannyfs_path& from, const cannyfs_path& to)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_LINKAT;
+		call.at(from);
+		call.at2(to);
+		return call;
+	}
+
+	static cannyfs_syscall writev(int fd, off_t offset, shared_ptr<cannyfs_writepayload> payload)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_WRITEV;
+		call.fd = fd;
+		call.offset = offset;
+		call.payload = move(payload);
+		return call;
+	}
+
+	static cannyfs_syscall fsync(int fd, bool datasync)
+	{
+		cannyfs_syscall call;
+		call.opcode = IORING_OP_FSYNC;
+		call.fd = fd;
+		call.flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+		return call;
+	}
+
+	// For ops that are over before they get to the backend
+	static cannyfs_syscall done(int res)
+	{
+		cannyfs_syscall call;
+		call.then = [res](int) { return res; };
+		return call;
+	}
+
+	// The synchronous backend
+	int direct() const
+	{
+		int res = 0;
+		switch (opcode)
+		{
+		case IORING_OP_OPENAT:
+			res = openat(dirfd, path, flags, mode);
+			break;
+		case IORING_OP_CLOSE:
+			res = ::close(fd);
+			break;
+		case IORING_OP_MKDIRAT:
+			res = mkdirat(dirfd, path, mode);
+			break;
+		case IORING_OP_UNLINKAT:
+			res = unlinkat(dirfd, path, flags);
+			break;
+		case IORING_OP_RENAMEAT:
+			res = flags ? renameat2(dirfd, path, dirfd2, path2, flags) : renameat(dirfd, path, dirfd2, path2);
+			break;
+		case IORING_OP_SYMLINKAT:
+			res = symlinkat(target.c_str(), dirfd, path);
+			break;
+		case IORING_OP_LINKAT:
+			res = linkat(dirfd, path, dirfd2, path2, 0);
+			break;
+		case IORING_OP_WRITEV:
+			res = pwritev(fd, payload->iov.data(), payload->iov.size(), offset);
+			break;
+		case IORING_OP_FSYNC:
+			res = (flags & IORING_FSYNC_DATASYNC) ? fdatasync(fd) : ::fsync(fd);
+			break;
+		}
+
+		return res == -1 ? -errno : res;
+	}
+
+	void prep(io_uring_sqe* sqe) const
+	{
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = dirfd;
+		sqe->addr = (uint64_t) path;
+		switch (opcode)
+		{
+		case IORING_OP_OPENAT:
+			sqe->len = mode;
+			sqe->open_flags = flags;
+			if (slot >= 0) sqe->file_index = slot + 1;
+			break;
+		case IORING_OP_CLOSE:
+			sqe->fd = slot >= 0 ? 0 : fd;
+			if (slot >= 0) sqe->file_index = slot + 1;
+			break;
+		case IORING_OP_WRITEV:
+			sqe->fd = slot >= 0 ? slot : fd;
+			if (slot >= 0) sqe->flags |= IOSQE_FIXED_FILE;
+			sqe->addr = (uint64_t) payload->iov.data();
+			sqe->len = payload->iov.size();
+			sqe->off = offset;
+			break;
+		case IORING_OP_FSYNC:
+			sqe->fd = fd;
+			sqe->fsync_flags = flags;
+			break;
+		case IORING_OP_MKDIRAT:
+			sqe->len = mode;
+			break;
+		case IORING_OP_UNLINKAT:
+			sqe->unlink_flags = flags;
+			break;
+		case IORING_OP_RENAMEAT:
+			sqe->len = dirfd2;
+			sqe->addr2 = (uint64_t) path2;
+			sqe->rename_flags = flags;
+			break;
+		case IORING_OP_SYMLINKAT:
+			sqe->addr = (uint64_t) target.c_str();
+			sqe->addr2 = (uint64_t) path;
+			break;
+		case IORING_OP_LINKAT:
+			sqe->len = dirfd2;
+			sqe->addr2 = (uint64_t) path2;
+			break;
+		}
+	}
+};
+
+// Returned by an op that was handed to the io_uring backend, it completes later
+const int CANNYFS_SUSPENDED = numeric_limits<int>::min();
+
+// An op handed to the io_uring backend
+struct cannyfs_uringop
+{
+	cannyfs_syscall call;
+	function<int(int)> tail;
+	// The queue to resume once done, if any
+	cannyfs_filedata* file;
+	long long bytes;
+	// The direct descriptor to give back once done, if any
+	int slot = -1;
+};
+
+// The ops of a file handle from create to release, which go to the ring as one chain of linked syscalls.
+// The file is opened as a direct descriptor, so the writes and the close need not wait for its fd.
+// A small file's chain can also be packed, made back to back by the synchronous backend with its fd in place of the slot.
+struct cannyfs_chain
+{
+	int slot = -1;
+	// Made with the synchronous backend by cannyfs_runpacked instead, for --packsmallfiles
+	bool packed = false;
+	vector<cannyfs_uringop*> ops;
+};
+
+// The op a queue runner is executing on this thread
+struct cannyfs_opcontext
+{
+	cannyfs_filedata* file;
+	long long bytes = 0;
+	bool suspended = false;
+	cannyfs_chain* chain = nullptr;
+};
+
+thread_local cannyfs_opcontext* cannyfs_currentop = nullptr;
+
+// The direct descriptor an op body should use, or -1 if it is not part of a chain
+int cannyfs_chainslot()
+{
+	return cannyfs_currentop && cannyfs_currentop->chain ? cannyfs_currentop->chain->slot : -1;
+}
+
+// io_uring backend for deferred ops, --backend=uring. A queue runner submits the backend syscall of an op
+// and moves on to other files. A single reaper thread completes the op and resumes that file's queue,
+// so a few workers keep as many ops in flight as admission allows.
+struct cannyfs_uring
+{
+private:
+	int ringfd = -1;
+	void* sqring = MAP_FAILED;
+	void* cqring = MAP_FAILED;
+	void* sqemap = MAP_FAILED;
+	size_t sqringsize = 0;
+	size_t cqringsize = 0;
+	size_t sqemapsize = 0;
+	unsigned* sqtail;
+	unsigned sqmask;
+	unsigned* sqarray;
+	io_uring_sqe* sqes;
+	unsigned* cqhead;
+	unsigned* cqtail;
+	unsigned cqmask;
+	io_uring_cqe* cqes;
+	unsigned sqentries;
+	unsigned cqentries;
+	bool supported[IORING_OP_LAST] = {};
+	bool linkedfiles = false;
+
+	// Ops are submitted from a thread of our own. Work the kernel punts to its workers belongs to the
+	// submitting thread, and is cancelled if that thread exits, as temporary pool workers do.
+	mutex lock;
+	condition_variable room;
+	condition_variable queued;
+	deque<vector<cannyfs_uringop*> > pending;
+	unsigned inflight = 0;
+	thread submitter;
+	thread reaper;
+	// Set if the reaper can't be told to stop, as the ring failed
+	bool orphaned = false;
+	// Free slots in the registered file table
+	vector<int> slots;
+
+	static int enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+	{
+		return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+	}
+
+	template<class T> T* at(void* ring, unsigned offset)
+	{
+		return (T*) ((char*) ring + offset);
+	}
+
+	// Queues ops to be submitted in one go, linked into a chain if there are several
+	void push(vector<cannyfs_uringop*>&& ops)
+	{
+		lock_guard<mutex> _(lock);
+		pending.push_back(move(ops));
+		queued.notify_one();
+	}
+
+	void submitloop()
+	{
+		unique_lock<mutex> l(lock);
+		bool stopping = false;
+		while (!stopping)
+		{
+			queued.wait(l, [this] { return !pending.empty(); });
+
+			unsigned tail = *sqtail;
+			unsigned filled = 0;
+			while (!pending.empty())
+			{
+				vector<cannyfs_uringop*>& ops = pending.front();
+				const unsigned count = ops.size();
+				if (filled + count > sqentries)
+				{
+					break;
+				}
+				// Keep the completion queue from overflowing
+				if (inflight + filled + count > cqentries)
+				{
+					if (filled) break;
+					room.wait(l, [this, count] { return inflight + count <= cqentries; });
+				}
+
+				for (unsigned i = 0; i < count; i++)
+				{
+					unsigned index = (tail + filled + i) & sqmask;
+					io_uring_sqe& sqe = sqes[index];
+					if (ops[i])
+					{
+						ops[i]->call.prep(&sqe);
+					}
+					else
+					{
+						memset(&sqe, 0, sizeof(sqe));
+						sqe.opcode = IORING_OP_NOP;
+						stopping = true;
+					}
+					if (i + 1 < count)
+					{
+						sqe.flags |= IOSQE_IO_LINK;
+					}
+					sqe.user_data = (uint64_t) ops[i];
+					sqarray[index] = index;
+				}
+				filled += count;
+				pending.pop_front();
+			}
+
+			const unsigned end = tail + filled;
+			__atomic_store_n(sqtail, end, __ATOMIC_RELEASE);
+			inflight += filled;
+			update_maximum(peakinflight, (long long) inflight);
+			l.unlock();
+
+			while (filled)
+			{
+				int ret = enter(ringfd, filled, 0, 0);
+				if (ret < 0)
+				{
+					if (errno == EINTR) continue;
+					if (errno == EAGAIN || errno == EBUSY)
+					{
+						// The kernel is out of room until completions are reaped, give the reaper a go at them
+						unique_lock<mutex> waiting(lock);
+						const unsigned before = inflight;
+						room.wait_for(waiting, chrono::milliseconds(1), [this, before] { return inflight < before; });
+						continue;
+					}
+
+					cerr << "[cannyfs] io_uring submit failed: " << strerror(errno) << "\n";
+					unsubmit(end, filled, -errno);
+					break;
+				}
+				filled -= ret;
+			}
+			l.lock();
+		}
+	}
+
+	// Take the last count entries before end back from the submission queue, and fail their ops
+	void unsubmit(unsigned end, unsigned count, int err)
+	{
+		vector<cannyfs_uringop*> ops;
+		for (unsigned i = end - count; i != end; i++)
+		{
+			ops.push_back((cannyfs_uringop*) sqes[sqarray[i & sqmask]].user_data);
+		}
+		// The kernel only reads the tail when we enter, and we are the only ones who do for submissions
+		__atomic_store_n(sqtail, end - count, __ATOMIC_RELEASE);
+		{
+			lock_guard<mutex> _(lock);
+			inflight -= count;
+		}
+		room.notify_all();
+
+		for (auto op : ops)
+		{
+			if (op)
+			{
+				finish(op, err);
+			}
+			else
+			{
+				// The request to stop never reaches the reaper
+				orphaned = true;
+			}
+		}
+	}
+
+	void finish(cannyfs_uringop* op, int res)
+	{
+		if (op->slot >= 0)
+		{
+			putslot(op->slot, res == 0);
+		}
+		if (op->call.then)
+		{
+			res = op->call.then(res);
+		}
+		op->tail(res);
+		admission.retire(op->bytes);
+		completed++;
+
+		cannyfs_filedata* file = op->file;
+		delete op;
+		if (file)
+		{
+			workqueue.submit([file]
+			{
+				if (file->run())
+				{
+					filemap.release(file);
+				}
+			});
+		}
+	}
+
+	// closed is false if the chain broke before the close, then the slot still holds the file
+	void putslot(int slot, bool closed)
+	{
+		if (!closed)
+		{
+			int none = -1;
+			io_uring_files_update update;
+			memset(&update, 0, sizeof(update));
+			update.offset = slot;
+			update.fds = (uint64_t) &none;
+			syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		}
+
+		lock_guard<mutex> _(lock);
+		slots.push_back(slot);
+	}
+
+	void reap()
+	{
+		vector<pair<cannyfs_uringop*, int>> done;
+		bool stopping = false;
+		while (!stopping)
+		{
+			if (enter(ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			{
+				cerr << "[cannyfs] io_uring wait failed: " << strerror(errno) << "\n";
+			}
+
+			done.clear();
+			unsigned head = *cqhead;
+			unsigned tail = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++)
+			{
+				io_uring_cqe& cqe = cqes[head & cqmask];
+				done.emplace_back((cannyfs_uringop*) cqe.user_data, cqe.res);
+			}
+			__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+			if (done.empty()) continue;
+
+			{
+				lock_guard<mutex> _(lock);
+				inflight -= done.size();
+			}
+			room.notify_all();
+
+			for (auto& completion : done)
+			{
+				if (completion.first)
+				{
+					finish(completion.first, completion.second);
+				}
+				else
+				{
+					stopping = true;
+				}
+			}
+		}
+	}
+
+	void unmap()
+	{
+		if (sqemap != MAP_FAILED) munmap(sqemap, sqemapsize);
+		if (cqring != MAP_FAILED && cqring != sqring) munmap(cqring, cqringsize);
+		if (sqring != MAP_FAILED) munmap(sqring, sqringsize);
+		sqemap = cqring = sqring = MAP_FAILED;
+		close(ringfd);
+		ringfd = -1;
+	}
+
+public:
+	atomic_llong submitted{ 0 };
+	atomic_llong completed{ 0 };
+	atomic_llong direct{ 0 };
+	atomic_llong peakinflight{ 0 };
+	atomic_llong chains{ 0 };
+	atomic_llong chainedops{ 0 };
+
+	bool active() const
+	{
+		return ringfd != -1;
+	}
+
+	bool supports(uint8_t opcode) const
+	{
+		return opcode != IORING_OP_NOP && opcode < IORING_OP_LAST && supported[opcode];
+	}
+
+	// The longest chain we may submit, 0 if the kernel can't chain a file's ops through a direct descriptor
+	size_t maxchain() const
+	{
+		if (!active() || !linkedfiles || !supports(IORING_OP_OPENAT) || !supports(IORING_OP_WRITEV) || !supports(IORING_OP_CLOSE))
+		{
+			return 0;
+		}
+
+		return min(sqentries, cqentries);
+	}
+
+	// A direct descriptor for a chain, -1 if all are taken
+	int takeslot()
+	{
+		lock_guard<mutex> _(lock);
+		if (slots.empty())
+		{
+			return -1;
+		}
+
+		int slot = slots.back();
+		slots.pop_back();
+		return slot;
+	}
+
+	// Falls back to the synchronous backend if the kernel won't give us a ring
+	bool start(unsigned entries)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		ringfd = syscall(__NR_io_uring_setup, entries, &p);
+		if (ringfd < 0)
+		{
+			cerr << "[cannyfs] io_uring unavailable (" << strerror(errno) << "), using the synchronous backend.\n";
+			ringfd = -1;
+			return false;
+		}
+
+		sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			sqringsize = cqringsize = max(sqringsize, cqringsize);
+		}
+		sqemapsize = p.sq_entries * sizeof(io_uring_sqe);
+
+		sqring = mmap(0, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+		cqring = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqring :
+			mmap(0, cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		sqemap = mmap(0, sqemapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+		if (sqring == MAP_FAILED || cqring == MAP_FAILED || sqemap == MAP_FAILED)
+		{
+			cerr << "[cannyfs] io_uring rings could not be mapped, using the synchronous backend.\n";
+			unmap();
+			return false;
+		}
+
+		sqtail = at<unsigned>(sqring, p.sq_off.tail);
+		sqmask = *at<unsigned>(sqring, p.sq_off.ring_mask);
+		sqarray = at<unsigned>(sqring, p.sq_off.array);
+		sqes = (io_uring_sqe*) sqemap;
+		cqhead = at<unsigned>(cqring, p.cq_off.head);
+		cqtail = at<unsigned>(cqring, p.cq_off.tail);
+		cqmask = *at<unsigned>(cqring, p.cq_off.ring_mask);
+		cqes = at<io_uring_cqe>(cqring, p.cq_off.cqes);
+		sqentries = p.sq_entries;
+		cqentries = p.cq_entries;
+
+		// Ops the kernel can't do through the ring are made directly
+		const int PROBE_OPS = 256;
+		unique_ptr<char[]> probemem(new char[sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op)]());
+		io_uring_probe* probe = (io_uring_probe*) probemem.get();
+		if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0)
+		{
+			for (int i = 0; i < probe->ops_len; i++)
+			{
+				if (probe->ops[i].op < IORING_OP_LAST)
+				{
+					supported[probe->ops[i].op] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+				}
+			}
+		}
+
+		// A sparse file table for the direct descriptors of chains, one per submission slot is plenty.
+		// Linked ops must pick up a direct descriptor only once the op before has opened it.
+		if (p.features & IORING_FEAT_LINKED_FILE)
+		{
+			vector<int> none(p.sq_entries, -1);
+			if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES, none.data(), none.size()) == 0)
+			{
+				linkedfiles = true;
+				for (int slot = p.sq_entries - 1; slot >= 0; slot--)
+				{
+					slots.push_back(slot);
+				}
+			}
+		}
+
+		submitter = thread([this] { submitloop(); });
+		reaper = thread([this] { reap(); });
+		cerr << "[cannyfs] Using the io_uring backend with " << p.sq_entries << " entries.\n";
+
+		return true;
+	}
+
+	// Hands the op to the ring, or adds it to the chain being built. tail runs on the reaper thread once it completes.
+	void submit(cannyfs_syscall&& call, function<int(int)>&& tail, cannyfs_opcontext& context)
+	{
+		context.suspended = true;
+		submitted++;
+		if (context.chain)
+		{
+			context.chain->ops.push_back(new cannyfs_uringop{ move(call), move(tail), nullptr, context.bytes });
+			return;
+		}
+
+		push({ new cannyfs_uringop{ move(call), move(tail), context.file, context.bytes } });
+	}
+
+	// The last op resumes the queue of file and gives back the direct descriptor
+	void submitchain(cannyfs_chain& chain, cannyfs_filedata* file)
+	{
+		chain.ops.back()->file = file;
+		chain.ops.back()->slot = chain.slot;
+		chains++;
+		chainedops += chain.ops.size();
+		push(move(chain.ops));
+	}
+
+	void stop()
+	{
+		if (!active()) return;
+
+		// A request without an op tells both threads to finish
+		push({ nullptr });
+		submitter.join();
+		if (orphaned)
+		{
+			// Left waiting on a ring we can't use, which then stays mapped for it
+			reaper.detach();
+			return;
+		}
+		reaper.join();
+		unmap();
+	}
+
+	void report()
+	{
+		if (!submitted && !direct) return;
+
+		cerr << "[cannyfs] io_uring backend: " << submitted << " ops submitted, " << completed << " completed, " << direct << " made directly, peak " << peakinflight << " in flight, "
+			<< chains << " files chained covering " << chainedops << " ops.\n";
+	}
+} uring;
+
+// Makes the syscalls of a packed chain: the open, the writes to the fd it returns and the close. Like on the ring,
+// the ops after a failed one are cancelled, but the file still gets closed.
+void cannyfs_runpacked(cannyfs_chain& chain)
+{
+	int fd = -1;
+	bool failed = false;
+	for (cannyfs_uringop* op : chain.ops)
+	{
+		cannyfs_syscall& call = op->call;
+		int res = -ECANCELED;
+		if (!failed)
+		{
+			if (call.opcode == IORING_OP_WRITEV || call.opcode == IORING_OP_CLOSE)
+			{
+				call.fd = fd;
+			}
+			res = call.direct();
+			if (call.opcode == IORING_OP_OPENAT && res >= 0)
+			{
+				fd = res;
+			}
+			else if (call.opcode == IORING_OP_CLOSE)
+			{
+				fd = -1;
+			}
+			failed = res < 0;
+		}
+
+		if (call.then)
+		{
+			res = call.then(res);
+		}
+		op->tail(res);
+		admission.retire(op->bytes);
+		delete op;
+	}
+	chain.ops.clear();
+
+	if (fd >= 0)
+	{
+		::close(fd);
+	}
+	holds.packed++;
+}
+
+// Makes the backend syscall of an op. A deferred op on the io_uring backend is only submitted,
+// and the queue runner moves on. The writer then has to let go of its op lock here,
+// tail will release it from the reaper thread.
+int cannyfs_backendcall(bool deferred, cannyfs_syscall&& call, cannyfs_writer& writer, function<int(int)>&& tail)
+{
+	cannyfs_opcontext* context = cannyfs_currentop;
+	if (deferred && context && context->chain && context->chain->packed)
+	{
+		writer.unlockop();
+		context->suspended = true;
+		context->chain->ops.push_back(new cannyfs_uringop{ move(call), move(tail), nullptr, context->bytes });
+
+		return CANNYFS_SUSPENDED;
+	}
+
+	// Within a chain, even ops that are already done take their place, so they complete in order
+	if (deferred && context && uring.active() && (context->chain || uring.supports(call.opcode)))
+	{
+		writer.unlockop();
+		uring.submit(move(call), move(tail), *context);
+
+		return CANNYFS_SUSPENDED;
+	}
+
+	if (uring.active()) uring.direct++;
+	int res = call.direct();
+	if (call.then)
+	{
+		res = call.then(res);
+	}
+
+	return tail(res);
+}
+
+// The number of ops from the front of the queue that make up the whole life of a created file handle,
+// 0 unless its create, writes and release are all queued with nothing else in between
+size_t cannyfs_filedata::chainable(cannyfs_opstate& state)
+{
+	// With the late close list, the handle's fd outlives its release
+	const size_t limit = options.closeverylate ? 0 : state.ops.size();
+	if (!limit || (state.ops.front().kind != OP_CREATE && state.ops.front().kind != OP_OPEN))
+	{
+		return 0;
+	}
+
+	const uint64_t fh = state.ops.front().fh;
+	for (size_t i = 1; i < limit; i++)
+	{
+		const cannyfs_op& op = state.ops[i];
+		if (op.fh != fh || op.kind == OP_OTHER || op.kind == OP_CREATE || op.kind == OP_OPEN)
+		{
+			return 0;
+		}
+		if (op.kind == OP_RELEASE)
+		{
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+// Whether the chain of length ops at the front is for a small enough file to pack
+bool cannyfs_filedata::packable(cannyfs_opstate& state, size_t length)
+{
+	if (options.packsmallfiles <= 0) return false;
+
+	long long bytes = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		if (state.ops[i].write)
+		{
+			bytes += state.ops[i].write->size;
+		}
+	}
+
+	return bytes <= options.packsmallfiles;
+}
+
+bool cannyfs_filedata::run()
+{
+	unique_lock<mutex> locallock(this->datalock);
+	// Can't be trimmed away while running
+	shared_ptr<cannyfs_opstate> state = opstate;
+	state->running = true;
+	while (!state->ops.empty())
+	{
+		if (state->ops.front().eventId <= state->elidedThrough)
+		{
+			cannyfs_op op = move(state->ops.front());
+			state->ops.pop_front();
+			update_maximum(state->firstEventId, op.eventId);
+			state->processed.notify_all();
+			admission.retire(op.bytes);
+			continue;
+		}
+
+		size_t length = chainable(*state);
+		cannyfs_chain chain;
+		bool chained = length && length <= uring.maxchain() && (chain.slot = uring.takeslot()) >= 0;
+		if (length && !chained && packable(*state, length))
+		{
+			// Any slot tells the op bodies that they are in a chain, the fd takes its place
+			chain.packed = chained = true;
+			chain.slot = 0;
+		}
+		if (chained)
+		{
+			for (size_t i = 0; i < length; i++)
+			{
+				cannyfs_op op = move(state->ops.front());
+				state->ops.pop_front();
+
+				if (op.write && !op.write->absorbed)
+				{
+					coalesce(*state, *op.write);
+				}
+
+				locallock.unlock();
+				cannyfs_opcontext context{ this };
+				context.chain = &chain;
+				cannyfs_currentop = &context;
+				op.run();
+				cannyfs_currentop = nullptr;
+				locallock.lock();
+			}
+			locallock.unlock();
+			if (!chain.packed)
+			{
+				uring.submitchain(chain, this);
+				return false;
+			}
+
+			holds.packedops += length;
+			cannyfs_runpacked(chain);
+			locallock.lock();
+			continue;
+		}
+
+		cannyfs_op op = move(state->ops.front());
+		state->ops.pop_front();
+
+		if (op.write && !op.write->absorbed)
+		{
+			coalesce(*state, *op.write);
+		}
+
+		locallock.unlock();
+		cannyfs_opcontext context{ this };
+		cannyfs_currentop = &context;
+		op.run();
+		cannyfs_currentop = nullptr;
+		if (context.suspended)
+		{
+			return false;
+		}
+		locallock.lock();
+	}
+	state->running = false;
+	trim();
+
+	return true;
+}
+
+// Let first absorb the contiguous writes through the same handle queued right behind it.
+// Only fully staged writes are taken, which all are by the time they are queued.
+// Call with datalock held.
+void cannyfs_filedata::coalesce(cannyfs_opstate& state, cannyfs_pendingwrite& first)
+{
+	off_t end = first.offset + first.size;
+	size_t total = first.size;
+	for (auto& next : state.ops)
+	{
+		cannyfs_pendingwrite* write = next.write.get();
+		if (!write || write->fh != first.fh || write->offset != end || !write->staged ||
+			first.merged.size() + 1 >= IOV_MAX || total + write->size > MAX_COALESCED_BYTES)
+		{
+			break;
+		}
+
+		write->absorbed = true;
+		first.merged.push_back(next.write);
+		end += write->size;
+		total += write->size;
+	}
+}
+
+void cannyfs_filedata::start()
+{
+	opstate->running = true;
+	workqueue.submit([this] {
+		if (run())
+		{
+			filemap.release(this);
+		}
+	});
+}
+
+void cannyfs_filedata::letgo()
+{
+	if (!opstate || !opstate->held) return;
+
+	opstate->held = false;
+	if (holds.forget(this))
+	{
+		filemap.release(this);
+	}
+	// The pin taken for the runner when it was held
+	start();
+}
+
+void cannyfs_holds::letgoall()
+{
+	set<cannyfs_filedata*> held;
+	{
+		lock_guard<mutex> _(lock);
+		if (files.empty()) return;
+		swap(held, files);
+	}
+
+	for (auto file : held)
+	{
+		{
+			unique_lock<mutex> _(file->datalock);
+			file->letgo();
+		}
+		filemap.release(file);
+	}
+}
+
+void cannyfs_letgoall()
+{
+	holds.letgoall();
+}
+
+// write describes any data staged for the op, beyond what is captured in fun itself. queued gets the event of the op.
+int cannyfs_add_write_inner(bool defer, const cannyfs_path& path, auto fun, shared_ptr<cannyfs_pendingwrite> write = nullptr, uint8_t kind = OP_OTHER, uint64_t fh = 0,
+	long long* queued = nullptr)
+{
+	filemap.pollsync();
+
+	long long eventIdNow;
+
+	unique_lock<mutex> lock;
+	cannyfs_filedata* fileobj = filemap.get(path, true, lock);
+
+	eventIdNow = ++::eventId;
+	if (queued) *queued = eventIdNow;
+
+	if (!defer) fileobj->spinevent(lock);
+
+	// A rename or link from here is still queued elsewhere, this op must not run before it
+	shared_ptr<cannyfs_source> source = move(fileobj->source);
+	if (source)
+	{
+		fileobj->pins--;
+	}
+
+	cannyfs_opstate& state = fileobj->state();
+	state.lastEventId = eventIdNow;
+	if (kind == OP_OTHER)
+	{
+		state.lastOtherEventId = eventIdNow;
+	}
+	if (write)
+	{
+		write->eventId = eventIdNow;
+		state.stage(write);
+	}
+
+	const long long bytes = (write ? write->size : 0) + sizeof(fun) + sizeof(function<int(void)>);
+	admission.charge(bytes);
+
+	auto worker = [defer, eventIdNow, fun, bytes, source]() {
+		if (options.verbose) fprintf(stderr, "Doing event ID %lld\n", eventIdNow);
+		if (source && !source->done)
+		{
+			cannyfs_reader reader(source->path, JUST_BARRIER, source->eventId);
+		}
+		if (defer) cannyfs_currentop->bytes = bytes;
+		int retval = fun(defer, eventIdNow);
+		// The backend retires it when it completes
+		if (retval == CANNYFS_SUSPENDED) return retval;
+		if (options.verbose) fprintf(stderr, "Did event ID %lld with result %d (total retired: %lld)\n", eventIdNow, retval, (long long) retiredCount);
+		admission.retire(bytes);
+		return retval;
+	};
+
+	if (!defer)
+	{
+		lock.unlock();
+		admission.admit(eventIdNow, bytes);
+		int retval = worker();
+		filemap.release(fileobj);
+		return retval;
+	}
+	else
+	{
+		const long long written = write ? write->size : 0;
+		state.ops.push_back({ worker, move(write), kind, fh, eventIdNow, bytes });
+		if (state.held)
+		{
+			// Only the writes and flushes of a small file wait for its release
+			if ((kind != OP_WRITE && kind != OP_FLUSH) || (state.heldbytes += written) > options.packsmallfiles)
+			{
+				fileobj->letgo();
+			}
+		}
+		else if (!state.running)
+		{
+			// The pin for the queue runner
+			fileobj->pins++;
+			if (kind == OP_CREATE && state.ops.size() == 1 && options.packsmallfiles > 0 && !options.closeverylate)
+			{
+				state.held = true;
+				state.heldbytes = 0;
+				fileobj->pins++;
+				holds.add(fileobj);
+			}
+			else
+			{
+				// Hey, WE will make it running now.
+				fileobj->start();
+			}
+		}
+		lock.unlock();
+		filemap.release(fileobj);
+		admission.admit(eventIdNow, bytes);
+
+		return 0;
+	}
+}
+
+// Picks the overload by what the op body returns, a result or a backend syscall
+template<class R, class T, class... Args>
+using cannyfs_returns = typename enable_if<is_same<typename result_of<T(Args...)>::type, R>::value, int>::type;
+
+template<class T, cannyfs_returns<int, T, cannyfs_path> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path, T fun, bool dir = false)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (A) for %s\n", funcname, path.c_str());
+	return cannyfs_add_write_inner(defer, path, [path, fun, funcname, dir](bool deferred, long long eventId)->int {
+		cannyfs_writer writer(path, LOCK_WHOLE, eventId, dir);
+		return cannyfs_guarderror(deferred, funcname, path.str(), fun(path));
+	});
+}
+
+// The last op queued on path so far, or -1 if none is pending. An op on another path that uses the entry at path
+// waits for just these, the ops queued after it are for whatever comes to be at path next.
+long long cannyfs_lastevent(const cannyfs_path& path)
+{
+	unique_lock<mutex> lock;
+	cannyfs_filedata* fileobj = filemap.get(path, false, lock);
+	if (!fileobj) return -1;
+
+	const long long last = fileobj->opstate && fileobj->opstate->busy() ? (long long) fileobj->opstate->lastEventId : -1;
+	lock.unlock();
+	filemap.release(fileobj);
+
+	return last;
+}
+
+// Take down the source of an op from path, if it is still the one posted there
+void cannyfs_unpostsource(const cannyfs_path& path, const shared_ptr<cannyfs_source>& source)
+{
+	unique_lock<mutex> lock;
+	cannyfs_filedata* fileobj = filemap.get(path, false, lock);
+	if (!fileobj) return;
+
+	if (fileobj->source == source)
+	{
+		fileobj->source.reset();
+		fileobj->pins--;
+	}
+	lock.unlock();
+	filemap.release(fileobj);
+}
+
+// In turn, what is queued on path1 next waits for the queued op on path2 that uses the entry at path1,
+// or a new file made there in the meantime would be moved along. It is left for that next op to pick up,
+// so nothing is queued on path1 for it.
+void cannyfs_postsource(bool defer, const cannyfs_path& path1, const shared_ptr<cannyfs_source>& source, long long targetEvent)
+{
+	if (!defer || !source) return;
+
+	source->eventId = targetEvent;
+	{
+		cannyfs_reader b(path1, NO_BARRIER | LOCK_WHOLE);
+		if (!b.fileobj->source)
+		{
+			b.fileobj->pins++;
+		}
+		b.fileobj->source = source;
+	}
+	source->posted = true;
+	if (source->done)
+	{
+		cannyfs_unpostsource(path1, source);
+	}
+}
+
+// Called by the op once it is done
+void cannyfs_settlesource(const cannyfs_path& path1, const shared_ptr<cannyfs_source>& source)
+{
+	if (!source) return;
+
+	source->done = true;
+	if (source->posted)
+	{
+		cannyfs_unpostsource(path1, source);
+	}
+}
+
+template<class T, cannyfs_returns<int, T, cannyfs_path, fuse_file_info*> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path, fuse_file_info* origfi, T fun, bool dir = false, shared_ptr<cannyfs_pendingwrite> write = nullptr)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (B) for %s\n", funcname, path.c_str());
+	fuse_file_info fi = *origfi;
+	return cannyfs_add_write_inner(defer, path, [path, fun, fi, funcname, dir](bool deferred, long long eventId)->int {
+		cannyfs_writer writer(path, LOCK_WHOLE, eventId, dir);
+		return cannyfs_guarderror(deferred, funcname, path.str(), fun(path, &fi));
+	}, move(write));
+}
+
+template<class T, cannyfs_returns<int, T, cannyfs_path, cannyfs_path> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path1, const cannyfs_path& path2, T fun, bool dir = false, bool sourced = true)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (C) for %s\n", funcname, path1.c_str());
+	const long long sourceEvent = sourced ? cannyfs_lastevent(path1) : -1;
+	shared_ptr<cannyfs_source> source = sourced && defer ? make_shared<cannyfs_source>(path2) : nullptr;
+	long long queued;
+	int res = cannyfs_add_write_inner(defer, path2, [path1, path2, fun, funcname, dir, sourceEvent, source](bool deferred, long long eventId)->int {
+		//cannyfs_writer writer1(path1, LOCK_WHOLE, eventId);
+
+		int res;
+		{
+			// TODO: LOCKING MODEL MESSED UP
+			cannyfs_reader reader(path1, JUST_BARRIER, sourceEvent);
+			ensure_parent(path1, eventId);
+			cannyfs_writer writer2(path2, LOCK_WHOLE, eventId, dir);
+
+			res = cannyfs_guarderror(deferred, funcname, path1.str(), fun(path1, path2));
+		}
+		cannyfs_settlesource(path1, source);
+
+		return res;
+	}, nullptr, OP_OTHER, 0, &queued);
+	cannyfs_postsource(defer, path1, source, queued);
+
+	return res;
+}
+
+// The same for op bodies that describe their backend syscall, which the backend then makes.
+// The writer lives until the syscall completes, wherever that happens.
+template<class T, cannyfs_returns<cannyfs_syscall, T, cannyfs_path> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path, T fun, bool dir = false)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (A) for %s\n", funcname, path.c_str());
+	return cannyfs_add_write_inner(defer, path, [path, fun, funcname, dir](bool deferred, long long eventId)->int {
+		auto writer = make_shared<cannyfs_writer>(path, LOCK_WHOLE, eventId, dir);
+		return cannyfs_backendcall(deferred, fun(path), *writer, [writer, path, funcname, deferred](int res) {
+			return cannyfs_guarderror(deferred, funcname, path.str(), res);
+		});
+	});
+}
+
+template<class T, cannyfs_returns<cannyfs_syscall, T, cannyfs_path, fuse_file_info*> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path, fuse_file_info* origfi, T fun, bool dir = false, shared_ptr<cannyfs_pendingwrite> write = nullptr, uint8_t kind = OP_OTHER)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (B) for %s\n", funcname, path.c_str());
+	fuse_file_info fi = *origfi;
+	return cannyfs_add_write_inner(defer, path, [path, fun, fi, funcname, dir](bool deferred, long long eventId)->int {
+		auto writer = make_shared<cannyfs_writer>(path, LOCK_WHOLE, eventId, dir);
+		fuse_file_info localfi = fi;
+		return cannyfs_backendcall(deferred, fun(path, &localfi), *writer, [writer, path, funcname, deferred](int res) {
+			return cannyfs_guarderror(deferred, funcname, path.str(), res);
+		});
+	}, move(write), kind, fi.fh);
+}
+
+template<class T, cannyfs_returns<cannyfs_syscall, T, cannyfs_path, cannyfs_path> = 0>
+int cannyfs_func_add_write(const char* funcname, bool defer, const cannyfs_path& path1, const cannyfs_path& path2, T fun, bool dir = false, bool sourced = true)
+{
+	if (options.verbose) fprintf(stderr, "Adding write %s (C) for %s\n", funcname, path1.c_str());
+	const long long sourceEvent = sourced ? cannyfs_lastevent(path1) : -1;
+	shared_ptr<cannyfs_source> source = sourced && defer ? make_shared<cannyfs_source>(path2) : nullptr;
+	long long queued;
+	int res = cannyfs_add_write_inner(defer, path2, [path1, path2, fun, funcname, dir, sourceEvent, source](bool deferred, long long eventId)->int {
+		// TODO: LOCKING MODEL MESSED UP
+		cannyfs_reader reader(path1, JUST_BARRIER, sourceEvent);
+		ensure_parent(path1, eventId);
+		auto writer2 = make_shared<cannyfs_writer>(path2, LOCK_WHOLE, eventId, dir);
+
+		return cannyfs_backendcall(deferred, fun(path1, path2), *writer2, [writer2, path1, path2, funcname, deferred, source](int res) {
+			cannyfs_settlesource(path1, source);
+			return cannyfs_guarderror(deferred, funcname, path1.str(), res);
+		});
+	}, nullptr, OP_OTHER, 0, &queued);
+	cannyfs_postsource(defer, path1, source, queued);
+
+	return res;
+}
+
+// Prepend the function name, for error reporting
+#define cannyfs_add_write(...) cannyfs_func_add_write(__func__, __VA_ARGS__)
+
+static int cannyfs_getattr(const char *path, struct stat *stbuf)
+{
+	if (options.verbose) fprintf(stderr, "Going to get attributes for %s\n", path);
+
+	const bool inaccurate = options.inaccuratestat;
+	cannyfs_reader b(path, inaccurate ? (NO_BARRIER | LOCK_WHOLE) : JUST_BARRIER);
+
+	if (options.verbose && !b.fileobj)
+	{
+		fprintf(stderr, "File obj missing for getattr for %s\n", path);
+	}
+
+	if (inaccurate)
+	{
+		if (options.cachemissing && b.fileobj && b.fileobj->is(FILE_MISSING))
+		{
+			if (options.verbose) fprintf(stderr, "Reporting %s to be missing\n", path);
+			return -ENOENT;
+		}
+
+		bool hasstat = b.fileobj && b.fileobj->is(FILE_CREATED | FILE_HASTRUESTAT);
+		if (hasstat)
+		{
+			b.fileobj->stats.fill(stbuf, b.fileobj->size, b.fileobj->is(FILE_CREATED));
+
+			return 0;
+		}
+		b.lock.unlock();		
+
+		if (options.assumecreateddirempty)
+		{
+			cannyfs_reader parentdata(cannyfs_path(path).parent(), NO_BARRIER);
+
+			// If the parent dir was missing or is known not to exist, we can safely (?) assume that the subentry does not exist unless WE created it
+			if (parentdata.fileobj && (parentdata.fileobj->is(FILE_MISSING) || (parentdata.fileobj->is(FILE_CREATED) && !parentdata.fileobj->is(FILE_PARTIAL))))
+			{
+				return -ENOENT;
+			}
+		}
+
+		if (options.completedirs && !b.fileobj->is(FILE_LISTED))
+		{
+			cannyfs_reader parentdata(cannyfs_path(path).parent(), NO_BARRIER);
+			if (parentdata.fileobj && parentdata.fileobj->is(FILE_COMPLETE))
+			{
+				filemap.completemisses++;
+				return -ENOENT;
+			}
+		}
+
+		// The backend only knows about the entry once pending ops on its dir, like a rename of it, have run
+		cannyfs_reader parentbarrier(cannyfs_path(path).parent(), JUST_BARRIER);
+	}
+	int res = lstat(path, stbuf);
+	update_maximum(b.fileobj->size, stbuf->st_size);
+	stbuf->st_size = b.fileobj->size;
+
+	if (res == -1)
+	{
+		int err = errno;
+		if (options.cachemissing && err == ENOENT)
+		{
+			cannyfs_reader b2(path, NO_BARRIER);
+			b.fileobj->mark(FILE_MISSING);
+		}
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int cannyfs_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	if (options.inaccuratestat)
+	{
+		return cannyfs_getattr(path, stbuf);
+	}
+	cannyfs_reader b(path, JUST_BARRIER);
+
+	int res;
+
+	(void) path;
+
+	res = fstat(getfh(fi), stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int cannyfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	return fi ? cannyfs_fgetattr(path, stbuf, fi) : cannyfs_getattr(path, stbuf);
+}
+#endif
+
+static int cannyfs_access(const char *path, int mask)
 {
 	if (options.veryeageraccess) return 0;
 
-	// At least make the writes finish?
-	cannyfs_reader b(path, JUST_BARRIER);
+	// At least make the writes finish?
+	cannyfs_reader b(path, JUST_BARRIER);
+
+	if (options.eageraccess) return 0;
+
+	int res;
+
+	res = access(path, mask);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int cannyfs_readlink(const char *path, char *buf, size_t size)
+{
+	cannyfs_reader b(path, JUST_BARRIER);
+
+	int res;
+
+	res = readlink(path, buf, size - 1);
+	if (res == -1)
+		return -errno;
+
+	buf[res] = '\0';
+	return 0;
+}
+
+// Fills the stat model for the entries of a listed dir, --statwhenreaddir. One background task per listing
+// stats all of them relative to the dir, without going through the op queues or admission control.
+struct cannyfs_prefetch
+{
+	atomic_llong dirs{ 0 };
+	atomic_llong statted{ 0 };
+	atomic_llong skipped{ 0 };
+
+	void submit(const cannyfs_path& dir, vector<string>&& names)
+	{
+		dirs++;
+		auto batch = make_shared<vector<string> >(move(names));
+		workqueue.submit([this, dir, batch]
+		{
+			run(dir, *batch);
+		});
+	}
+
+	void run(const cannyfs_path& dir, const vector<string>& names)
+	{
+		int fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+		{
+			return;
+		}
+
+		for (const string& name : names)
+		{
+			cannyfs_path path = dir.child(name.c_str());
+			long long before;
+			{
+				// Anything we know better, or will change, is left to the model and the ops
+				cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+				if (b.fileobj->is(FILE_CREATED | FILE_MISSING | FILE_HASTRUESTAT))
+				{
+					skipped++;
+					continue;
+				}
+				before = b.fileobj->lastevent();
+			}
+
+			struct stat statdata;
+			if (fstatat(fd, name.c_str(), &statdata, AT_SYMLINK_NOFOLLOW) == -1)
+			{
+				continue;
+			}
+
+			cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+			// An op queued since, even one that already ran, might have changed the file under our stat
+			if (b.fileobj->is(FILE_CREATED | FILE_MISSING | FILE_HASTRUESTAT) || b.fileobj->lastevent() != before ||
+				(b.fileobj->opstate && !b.fileobj->opstate->quiescent()))
+			{
+				skipped++;
+				continue;
+			}
+			b.fileobj->stats = statdata;
+			update_maximum(b.fileobj->size, statdata.st_size);
+			b.fileobj->mark(FILE_HASTRUESTAT);
+			statted++;
+		}
+
+		close(fd);
+	}
+
+	void report()
+	{
+		if (!dirs) return;
+
+		cerr << "[cannyfs] Stat prefetch: " << dirs << " listings, " << statted << " entries statted, " << skipped << " left to the model.\n";
+	}
+} prefetch;
+
+struct cannyfs_dirent {
+	string name;
+	ino_t ino;
+	unsigned char type;
+};
+
+struct cannyfs_dirp {
+	DIR *dp;
+	struct dirent *entry;
+	off_t offset;
+	// Read from the start without skipping, so far
+	bool whole;
+	// Entries to prefetch stats for, once the listing is done
+	vector<string> unstatted;
+	// Listed from these instead of streaming from dp: a dir made by us, with no dp at all, or a backend
+	// listing with our pending changes merged in. Offsets are positions in it.
+	vector<cannyfs_dirent> entries;
+	bool overlay;
+};
+
+static int cannyfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+	cannyfs_dirp* d = new cannyfs_dirp;
+	if (d == NULL)
+		return -ENOMEM;
+
+	d->dp = NULL;
+	d->offset = 0;
+	d->entry = NULL;
+	d->whole = false;
+	d->overlay = false;
+	if (options.memorylistings)
+	{
+		cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+		if (b.fileobj->children && !b.fileobj->is(FILE_MISSING))
+		{
+			d->entries = { { ".", 0, DT_DIR }, { "..", 0, DT_DIR } };
+			for (auto& name : *b.fileobj->children)
+			{
+				d->entries.push_back({ name, 0, DT_UNKNOWN });
+			}
+		}
+	}
+	if (d->entries.empty()) {
+		if (options.overlaydirs) {
+			// Pending changes to the children are merged in by readdir. The dir itself has to be as on the backend,
+			// one made, moved or removed by us, or with any other op of its own pending, waits below.
+			bool settled;
+			{
+				cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+				settled = !b.fileobj->is(FILE_CREATED | FILE_MISSING) && !(b.fileobj->opstate && b.fileobj->opstate->busy());
+			}
+			if (settled) {
+				d->dp = opendir(path);
+				d->overlay = true;
+			}
+		}
+		if (d->dp == NULL) {
+			// With accurate dirs, ALL operations need to finish
+			cannyfs_dirreader b(path, JUST_BARRIER);
+			d->dp = opendir(path);
+		}
+		if (d->dp == NULL) {
+			res = -errno;
+			delete d;
+			return res;
+		}
+	}
+
+	fi->fh = getnewfh() - fhs.begin();
+	getcfh(fi->fh)->setfh((unsigned long)d);
+	return 0;
+}
+
+static inline struct cannyfs_dirp *get_dirp(struct fuse_file_info *fi)
+{
+	return (struct cannyfs_dirp *) (uintptr_t) getfh(fi);
+}
+
+#if FUSE_USE_VERSION >= 30
+// Full attributes for a readdirplus entry. They come from the stat model when it has them,
+// and otherwise from the backend, which then also seeds the model.
+static bool cannyfs_direntstat(const cannyfs_path& dir, DIR* dp, const char* name, struct stat* st)
+{
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		return fstatat(dirfd(dp), name, st, AT_SYMLINK_NOFOLLOW) != -1;
+	}
+
+	cannyfs_reader b(dir.child(name), NO_BARRIER | LOCK_WHOLE);
+	if (b.fileobj->is(FILE_MISSING))
+	{
+		return false;
+	}
+
+	if (!b.fileobj->is(FILE_CREATED | FILE_HASTRUESTAT))
+	{
+		if (fstatat(dirfd(dp), name, st, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			return false;
+		}
+
+		b.fileobj->stats = *st;
+		update_maximum(b.fileobj->size, st->st_size);
+		b.fileobj->mark(FILE_HASTRUESTAT);
+	}
+	b.fileobj->stats.fill(st, b.fileobj->size, b.fileobj->is(FILE_CREATED));
+
+	return true;
+}
+#endif
+
+// Read the whole backend listing, and add the children that our pending ops have yet to create there.
+// Those that they have yet to remove are skipped when served, like any removed since.
+static void cannyfs_overlaylisting(const cannyfs_path& dir, struct cannyfs_dirp *d, bool plus)
+{
+	set<string> pending;
+	{
+		cannyfs_reader b(dir, NO_BARRIER | LOCK_WHOLE);
+		if (b.fileobj->opstate)
+		{
+			for (auto& child : b.fileobj->opstate->pendingchildren)
+			{
+				pending.insert(child.first);
+			}
+		}
+		if (options.completedirs)
+		{
+			b.fileobj->mark(FILE_LISTING);
+		}
+	}
+
+	d->entries.clear();
+	rewinddir(d->dp);
+	while (struct dirent* entry = readdir(d->dp))
+	{
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+		{
+			pending.erase(entry->d_name);
+			if (options.completedirs)
+			{
+				cannyfs_reader child(dir.child(entry->d_name), NO_BARRIER | LOCK_WHOLE);
+				if (!child.fileobj->is(FILE_MISSING))
+				{
+					child.fileobj->mark(FILE_LISTED);
+				}
+			}
+			// A plus listing fills the stat model itself
+			if (options.statwhenreaddir && !plus)
+			{
+				d->unstatted.push_back(entry->d_name);
+			}
+		}
+		d->entries.push_back({ entry->d_name, entry->d_ino, entry->d_type });
+	}
+	for (auto& name : pending)
+	{
+		d->entries.push_back({ name, 0, DT_UNKNOWN });
+	}
+
+	if (!d->unstatted.empty())
+	{
+		prefetch.submit(dir, move(d->unstatted));
+		d->unstatted.clear();
+	}
+	if (options.completedirs)
+	{
+		cannyfs_reader listed(dir, NO_BARRIER | LOCK_WHOLE);
+		if (listed.fileobj->is(FILE_LISTING))
+		{
+			listed.fileobj->mark(FILE_LISTING, false);
+			listed.fileobj->mark(FILE_COMPLETE);
+		}
+	}
+}
+
+// Serve the entries taken by opendir or cannyfs_overlaylisting, with attributes from the model where it has them.
+// Entries removed since are skipped.
+static void cannyfs_snapshotreaddir(const cannyfs_path& dir, struct cannyfs_dirp *d, void *buf, fuse_fill_dir_t filler,
+	off_t offset, bool plus)
+{
+	for (size_t i = offset; i < d->entries.size(); i++)
+	{
+		const cannyfs_dirent& entry = d->entries[i];
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = entry.ino;
+		st.st_mode = entry.type << 12;
+		bool full = false;
+		if (entry.name == "." || entry.name == "..")
+		{
+			full = plus && d->dp && fstatat(dirfd(d->dp), entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != -1;
+		}
+		else
+		{
+			cannyfs_reader b(dir.child(entry.name.c_str()), NO_BARRIER | LOCK_WHOLE);
+			if (b.fileobj->is(FILE_MISSING))
+			{
+				continue;
+			}
+			// The backend only knows better while no ops are pending
+			if (plus && d->dp && !b.fileobj->is(FILE_CREATED | FILE_HASTRUESTAT) && (!b.fileobj->opstate || b.fileobj->opstate->quiescent()))
+			{
+				struct stat real;
+				if (fstatat(dirfd(d->dp), entry.name.c_str(), &real, AT_SYMLINK_NOFOLLOW) != -1)
+				{
+					b.fileobj->stats = real;
+					update_maximum(b.fileobj->size, real.st_size);
+					b.fileobj->mark(FILE_HASTRUESTAT);
+				}
+			}
+			// An evicted child of a dir made by us only keeps its name
+			if (b.fileobj->is(FILE_CREATED | FILE_HASTRUESTAT))
+			{
+				b.fileobj->stats.fill(&st, b.fileobj->size, b.fileobj->is(FILE_CREATED));
+				full = plus;
+			}
+		}
+		(void) full;
+
+		if (filler(buf, entry.name.c_str(), &st, i + 1
+#if FUSE_USE_VERSION >= 30
+			, full ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags) 0
+#endif
+		))
+			break;
+	}
+}
+
+static int cannyfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi
+#if FUSE_USE_VERSION >= 30
+		       , enum fuse_readdir_flags flags
+#endif
+)
+{
+	cannyfs_path parsedpath = path;
+	struct cannyfs_dirp *d = get_dirp(fi);
+#if FUSE_USE_VERSION >= 30
+	const bool plus = flags & FUSE_READDIR_PLUS;
+#else
+	const bool plus = false;
+#endif
+
+	if (!d->dp || d->overlay) {
+		if (d->overlay && (offset == 0 || d->entries.empty()))
+			cannyfs_overlaylisting(parsedpath, d, plus);
+		cannyfs_snapshotreaddir(parsedpath, d, buf, filler, offset, plus);
+		return 0;
+	}
+
+	cannyfs_dirreader b(parsedpath, JUST_BARRIER);
+
+	(void) path;
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+		d->whole = false;
+	}
+	if (offset == 0 && options.completedirs) {
+		cannyfs_reader listed(parsedpath, NO_BARRIER | LOCK_WHOLE);
+		listed.fileobj->mark(FILE_LISTING);
+		d->whole = true;
+	}
+	while (1) {
+		struct stat st;
+		off_t nextoff;
+#if FUSE_USE_VERSION >= 30
+		enum fuse_fill_dir_flags fill_flags = (fuse_fill_dir_flags) 0;
+#endif
+
+		if (!d->entry) {
+			d->entry = readdir(d->dp);			
+			if (!d->entry) {
+				if (!d->unstatted.empty()) {
+					prefetch.submit(parsedpath, move(d->unstatted));
+					d->unstatted.clear();
+				}
+				if (d->whole) {
+					cannyfs_reader listed(parsedpath, NO_BARRIER | LOCK_WHOLE);
+					if (listed.fileobj->is(FILE_LISTING)) {
+						listed.fileobj->mark(FILE_LISTING, false);
+						listed.fileobj->mark(FILE_COMPLETE);
+					}
+					d->whole = false;
+				}
+				break;
+			}
+			if (d->whole && strcmp(d->entry->d_name, ".") && strcmp(d->entry->d_name, "..")) {
+				// Unless we have since removed or moved it
+				cannyfs_reader child(parsedpath.child(d->entry->d_name), NO_BARRIER | LOCK_WHOLE);
+				if (!child.fileobj->is(FILE_MISSING)) {
+					child.fileobj->mark(FILE_LISTED);
+				}
+			}
+			// A plus listing fills the stat model itself
+			if (options.statwhenreaddir && !plus && strcmp(d->entry->d_name, ".") && strcmp(d->entry->d_name, ".."))
+			{
+				d->unstatted.push_back(d->entry->d_name);
+			}
+		}
+#if FUSE_USE_VERSION >= 30
+		if (plus && cannyfs_direntstat(parsedpath, d->dp, d->entry->d_name, &st)) {
+			fill_flags = FUSE_FILL_DIR_PLUS;
+		}
+		if (!(fill_flags & FUSE_FILL_DIR_PLUS)) {
+#endif
+			memset(&st, 0, sizeof(st));
+			st.st_ino = d->entry->d_ino;
+			st.st_mode = d->entry->d_type << 12;
+#if FUSE_USE_VERSION >= 30
+		}
+#endif
+		nextoff = telldir(d->dp);
+		if (filler(buf, d->entry->d_name, &st, nextoff
+#if FUSE_USE_VERSION >= 30
+			, fill_flags
+#endif
+		))
+			break;
+
+		d->entry = NULL;
+		d->offset = nextoff;
+	}
+
+	return 0;
+}
+
+static int cannyfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct cannyfs_dirp *d = get_dirp(fi);
+	(void) path;
+	// Listed only in part
+	if (!d->unstatted.empty())
+	{
+		prefetch.submit(path, move(d->unstatted));
+	}
+	if (d->dp)
+		closedir(d->dp);
+	delete d;
+	return 0;
+}
+
+static int cannyfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	// Made right away, so a parent we made has to be there first
+	ensure_parent(path);
+	if (S_ISFIFO(mode))
+		res = mkfifo(path, mode);
+	else
+		res = mknod(path, mode, rdev);
+	if (res == -1)
+		return -errno;
+
+	{
+		// Exists, even if the parent was listed before
+		cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+		b.fileobj->mark(FILE_MISSING, false);
+		b.fileobj->mark(FILE_LISTED);
+	}
+	cannyfs_dirchild(path, true);
+
+	return 0;
+}
+
+static int cannyfs_mkdir(const char *path, mode_t mode)
+{
+	{
+		cannyfs_reader b(path, LOCK_WHOLE);
+		b.fileobj->mark(FILE_MISSING, false);
+		b.fileobj->mark(FILE_CREATED);
+		b.fileobj->mark(FILE_PARTIAL, false);
+		b.fileobj->stats.mode = mode | S_IFDIR;
+		if (options.memorylistings)
+		{
+			b.fileobj->children.reset(new set<string>);
+		}
+	}
+	cannyfs_dirchild(path, true);
+	cannyfs_pendingchild(path, 1);
+
+	return cannyfs_add_write(options.eagermkdir, path, [mode](const cannyfs_path& path) {
+		cannyfs_syscall call = cannyfs_syscall::mkdir(path, mode);
+		call.then = [path](int res)
+		{
+			cannyfs_pendingchild(path, -1);
+			return res;
+		};
+
+		return call;
+	});
+}
+
+void rm_bookkeeping(const char* path)
+{
+	cannyfs_path parsedpath = path;
+	
+	cannyfs_reader b(parsedpath, NO_BARRIER | LOCK_WHOLE);
+	b.fileobj->children.reset();
+	b.fileobj->mark(FILE_MISSING);
+	b.fileobj->mark(FILE_CREATED | FILE_LISTED, false);
+	b.fileobj->size = 0;
+	cannyfs_reader bp(parsedpath.parent(), NO_BARRIER | LOCK_WHOLE);
+	if (bp.fileobj->state().removers.insert(b.fileobj).second)
+	{
+		b.fileobj->pins++;
+	}
+	if (bp.fileobj->children)
+	{
+		bp.fileobj->children->erase(parsedpath.name());
+	}
+}
+
+
+struct cannyfs_elision
+{
+	atomic_llong files{ 0 };
+	atomic_llong ops{ 0 };
+	atomic_llong renames{ 0 };
+
+	void report()
+	{
+		if (!files && !renames) return;
+
+		cerr << "[cannyfs] Elision: " << files << " files unlinked before reaching the backend, " << ops << " ops dropped, "
+			<< renames << " renames folded into the create of their file.\n";
+	}
+} elision;
+
+// Where the queue ends with the whole life of a file created by us, none of it run yet: its create, then opens,
+// writes and flushes, with every handle released. Returns the index of the create, or -1. Call with datalock held.
+static long long cannyfs_untouched(cannyfs_opstate* state)
+{
+	if (!state) return -1;
+
+	long long first = state->ops.size() - 1;
+	while (first >= 0 && state->ops[first].kind != OP_CREATE)
+	{
+		first--;
+	}
+	if (first < 0)
+	{
+		return -1;
+	}
+
+	const cannyfs_op& create = state->ops[first];
+	if (create.eventId <= state->elidedThrough || create.eventId <= state->sourcedThrough || getcfh(create.fh)->movedto)
+	{
+		return -1;
+	}
+
+	// Every handle has been released, so nothing else can get at the file
+	set<uint64_t> handles;
+	for (size_t i = first; i < state->ops.size(); i++)
+	{
+		const cannyfs_op& op = state->ops[i];
+		switch (op.kind)
+		{
+		case OP_CREATE:
+		case OP_OPEN:
+			handles.insert(op.fh);
+			break;
+		case OP_RELEASE:
+			handles.erase(op.fh);
+			break;
+		case OP_WRITE:
+		case OP_FLUSH:
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return handles.empty() ? first : -1;
+}
+
+// An unlinked file whose create is still queued never has to reach the backend. Its queued ops are marked
+// for run to skip, and what they would have cleaned up after themselves is done here.
+static bool cannyfs_elide(const cannyfs_path& path)
+{
+	if (!options.elideunlinked) return false;
+
+	cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+	cannyfs_opstate* state = b.fileobj->opstate.get();
+	// Everything queued has to go, which is only the life of this file
+	if (cannyfs_untouched(state) != 0)
+	{
+		return false;
+	}
+
+	state->elidedThrough = state->lastEventId;
+	for (const cannyfs_op& op : state->ops)
+	{
+		if (op.write)
+		{
+			state->unstage(op.write.get());
+			if (op.write->consume())
+			{
+				piper.closepipe(op.write->pipe);
+			}
+		}
+		if (op.kind == OP_RELEASE)
+		{
+			getcfh(op.fh)->~cannyfs_filehandle();
+			new(getcfh(op.fh)) cannyfs_filehandle();
+			freefhs.push(fhs.begin() + op.fh);
+		}
+	}
+	cannyfs_pendingchild(path, -1);
+	elision.files++;
+	elision.ops += state->ops.size();
+	// A small file held for packing has nothing left to wait for, its runner just drops the ops and their charges
+	b.fileobj->letgo();
+
+	return true;
+}
+
+static int cannyfs_unlink(const char *path)
+{
+	rm_bookkeeping(path);
+	if (cannyfs_elide(path))
+	{
+		return 0;
+	}
+
+	return cannyfs_add_write(options.eagerunlink, path, [](const cannyfs_path& path) {
+		return cannyfs_syscall::unlink(path, 0);
+	});
+}
+
+static int cannyfs_rmdir(const char *path)
+{
+	rm_bookkeeping(path);
+
+	// Quite dangerous unless restrictive dirs is turned on, even if eagerrmdir is false!
+	return cannyfs_add_write(options.eagerrmdir, path, [](const cannyfs_path& path) {
+		cannyfs_syscall call = cannyfs_syscall::unlink(path, AT_REMOVEDIR);
+		call.then = [path](int res)
+		{
+			dirfds.forget(path);
+			return res;
+		};
+
+		return call;
+	}, true);
+}
+
+static int cannyfs_symlink(const char *from, const char *to)
+{
+	{
+		cannyfs_reader b(to, NO_BARRIER | LOCK_WHOLE);
+		b.fileobj->mark(FILE_MISSING, false);
+		b.fileobj->mark(FILE_CREATED);
+		b.fileobj->stats.mode = S_IRUSR | S_IWUSR | S_IFLNK;
+	}
+	cannyfs_dirchild(to, true);
+	cannyfs_pendingchild(to, 1);
+	// The target is just the content of the link, not a path to order against
+	return cannyfs_add_write(options.eagersymlink, (bf::path(to).parent_path() / from).string(), to, [fromreal = string(from)](const cannyfs_path& from, const cannyfs_path& to) {
+		cannyfs_syscall call = cannyfs_syscall::symlink(fromreal, to);
+		call.then = [to](int res)
+		{
+			cannyfs_pendingchild(to, -1);
+			return res;
+		};
+
+		return call;
+	}, false, false);
+}
+
+// Fold a rename into the queued create of from, so that the file is made at to in the first place. Only for
+// a file whose whole life is still queued, moved to a name known not to exist that nothing is queued for.
+// Returns the last event of from that the rename still has to wait for, or -1 if it has to go to the backend.
+static long long cannyfs_fuse(const cannyfs_path& from, const cannyfs_path& to)
+{
+	if (!options.fuserenames) return -1;
+
+	long long parentEvent = -1;
+	bool complete;
+	{
+		cannyfs_reader bp(to.parent(), NO_BARRIER | LOCK_WHOLE);
+		// A dir we know all the children of
+		complete = (options.completedirs && bp.fileobj->is(FILE_COMPLETE)) || bp.fileobj->children;
+		// The create has to wait for the new parent like the rename would, but not for anything queued later
+		if (bp.fileobj->opstate)
+		{
+			parentEvent = bp.fileobj->opstate->lastEventId;
+		}
+	}
+	{
+		cannyfs_reader bt(to, NO_BARRIER | LOCK_WHOLE);
+		cannyfs_opstate* state = bt.fileobj->opstate.get();
+		if (!bt.fileobj->is(FILE_MISSING) && (bt.fileobj->cached() || !complete))
+		{
+			return -1;
+		}
+		if (state && (!state->ops.empty() || state->running))
+		{
+			return -1;
+		}
+	}
+
+	cannyfs_reader b(from, NO_BARRIER | LOCK_WHOLE);
+	cannyfs_opstate* state = b.fileobj->opstate.get();
+	const long long first = cannyfs_untouched(state);
+	if (first < 0)
+	{
+		return -1;
+	}
+
+	// The create is still queued, so it will find this once it runs. Earlier lives of the name queued before it
+	// go their own way.
+	cannyfs_filehandle* cfh = getcfh(state->ops[first].fh);
+	cfh->movedto.reset(new cannyfs_path(to));
+	cfh->movedafter = parentEvent;
+	elision.renames++;
+
+	return state->lastEventId;
+}
+
+static int cannyfs_rename(const char *from, const char *to
+#if FUSE_USE_VERSION >= 30
+	, unsigned int flags
+#endif
+)
+{
+#if FUSE_USE_VERSION < 30
+	const unsigned int flags = 0;
+#endif
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+		return -EINVAL;
+
+	// The last event of from that a rename folded into its create waits for, -1 for a rename on the backend
+	long long through = -1;
+	auto bookkeeping = [from, to, flags, &through]
+	{
+		if (!(flags & RENAME_EXCHANGE))
+		{
+			cannyfs_dirchild(from, false);
+			cannyfs_dirchild(to, true);
+		}
+		cannyfs_reader b1(from, NO_BARRIER | LOCK_WHOLE);
+		cannyfs_reader b2(to, NO_BARRIER | LOCK_WHOLE);
+		// Tracked children stay under the old names, so a moved dir is no longer known to be complete
+		b1.fileobj->mark(FILE_COMPLETE | FILE_LISTING, false);
+		b2.fileobj->mark(FILE_COMPLETE | FILE_LISTING, false);
+		if (through < 0)
+		{
+			b1.fileobj->state().sourcedThrough = b1.fileobj->state().lastEventId;
+		}
+		b1.fileobj->children.reset();
+		b2.fileobj->children.reset();
+		if (flags & RENAME_EXCHANGE)
+		{
+			const uint8_t swapped = FILE_CREATED | FILE_MISSING | FILE_HASTRUESTAT | FILE_PARTIAL | FILE_LISTED;
+			const uint8_t flags1 = b1.fileobj->flags & swapped;
+			const uint8_t flags2 = b2.fileobj->flags & swapped;
+			for (uint8_t flag = 1; flag & swapped; flag <<= 1)
+			{
+				b1.fileobj->mark(flag, flags2 & flag);
+				b2.fileobj->mark(flag, flags1 & flag);
+			}
+			swap(b1.fileobj->stats, b2.fileobj->stats);
+			off_t size1 = b1.fileobj->size;
+			b1.fileobj->size = (off_t) b2.fileobj->size;
+			b2.fileobj->size = size1;
+
+			return;
+		}
+
+		b1.fileobj->mark(FILE_MISSING);
+		b1.fileobj->mark(FILE_LISTED, false);
+		b2.fileobj->mark(FILE_MISSING, false);
+		b2.fileobj->mark(FILE_CREATED);
+		// A renamed dir keeps its entries, which we know nothing about under the new name
+		b2.fileobj->mark(FILE_PARTIAL);
+		if (b1.fileobj->is(FILE_HASTRUESTAT | FILE_CREATED))
+		{
+			b1.fileobj->mark(FILE_HASTRUESTAT, false);
+			b2.fileobj->stats = b1.fileobj->stats;
+			b2.fileobj->size = (off_t) b1.fileobj->size;
+		}
+		else
+		{
+			b2.fileobj->stats.mode = S_IRUSR | S_IWUSR | S_IFREG;
+		}
+	};
+
+	auto op = [flags](const cannyfs_path& from, const cannyfs_path& to) {
+		cannyfs_syscall call = cannyfs_syscall::rename(from, to, flags);
+		// Cached fds of a moved or replaced dir would now resolve names in the wrong place
+		call.then = [from, to](int res)
+		{
+			dirfds.forget(from);
+			dirfds.forget(to);
+			cannyfs_pendingchild(to, -1);
+			return res;
+		};
+
+		return call;
+	};
+
+	cannyfs_pendingchild(to, 1);
+	if (flags)
+	{
+		// Only the backend knows whether the target exists, so the caller has to wait for the answer
+		int res = cannyfs_add_write(false, from, to, op);
+		if (!res)
+			bookkeeping();
+
+		return res;
+	}
+
+	through = cannyfs_fuse(from, to);
+	bookkeeping();
+	if (through >= 0)
+	{
+		// Nothing left to do on the backend, but whatever comes next for to still has to wait for the file to be made
+		return cannyfs_add_write(options.eagerrename, to, [from, through](const cannyfs_path& to) {
+			cannyfs_reader b(from, JUST_BARRIER, through);
+			cannyfs_syscall call = cannyfs_syscall::done(0);
+			call.then = [to](int res)
+			{
+				cannyfs_pendingchild(to, -1);
+				return res;
+			};
+
+			return call;
+		});
+	}
+
+	return cannyfs_add_write(options.eagerrename, from, to, op);
+}
+
+static int cannyfs_link(const char *cfrom, const char *cto)
+{
+	// TODO: Add created directory entry.
+	{
+		// Exists, even if the parent was listed before
+		cannyfs_reader b(cto, NO_BARRIER | LOCK_WHOLE);
+		b.fileobj->mark(FILE_MISSING, false);
+		b.fileobj->mark(FILE_LISTED);
+	}
+	{
+		cannyfs_reader b(cfrom, NO_BARRIER | LOCK_WHOLE);
+		b.fileobj->state().sourcedThrough = b.fileobj->state().lastEventId;
+	}
+	cannyfs_dirchild(cto, true);
+	cannyfs_pendingchild(cto, 1);
+	return cannyfs_add_write(options.eagerlink, cfrom, cto, [](const cannyfs_path& from, const cannyfs_path& to) {
+		cannyfs_syscall call = cannyfs_syscall::link(from, to);
+		call.then = [to](int res)
+		{
+			cannyfs_pendingchild(to, -1);
+			return res;
+		};
+
+		return call;
+	});
+}
+
+static int cannyfs_chmod(const char *cpath, mode_t mode)
+{
+	{
+		cannyfs_reader b(cpath, LOCK_WHOLE);
+		// TODO: Is this mask defined somewhere for real?
+		mode_t newmode = b.fileobj->stats.mode;
+		newmode &= numeric_limits<mode_t>::max() - 0xFFF;
+		newmode |= mode;
+
+		b.fileobj->stats.mode = newmode;
+	}
+	return cannyfs_add_write(options.eagerchmod, cpath, [mode](const cannyfs_path& path) {
+		int dirfd;
+		const char* name;
+		auto dir = dirfds.at(path, dirfd, name);
+		int res;
+		res = fchmodat(dirfd, name, mode, 0);
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+}
+
+#if FUSE_USE_VERSION >= 30
+static int cannyfs_chmod(const char *cpath, mode_t mode, struct fuse_file_info *fi)
+{
+	return cannyfs_chmod(cpath, mode);
+}
+#endif
+
+static int cannyfs_chown(const char *cpath, uid_t uid, gid_t gid)
+{
+	return cannyfs_add_write(options.eagerchown, cpath, [uid, gid](const cannyfs_path& path) {
+		int res;
+
+		int dirfd;
+		const char* name;
+		auto dir = dirfds.at(path, dirfd, name);
+		res = fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+}
+
+#if FUSE_USE_VERSION >= 30
+static int cannyfs_chown(const char *cpath, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	return cannyfs_chown(cpath, uid, gid);
+}
+#endif
+
+static int cannyfs_truncate(const char *cpath, off_t size)
+{
+	{
+		cannyfs_reader b(cpath, NO_BARRIER);
+		b.fileobj->size = size;
+	}
+	return cannyfs_add_write(options.eagertruncate, cpath, [size](const cannyfs_path& path) {
+		int res = truncate(path.c_str(), size);
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+}
+
+static int cannyfs_ftruncate(const char *cpath, off_t size,
+			 struct fuse_file_info *fi)
+{
+	{
+		cannyfs_reader b(cpath, NO_BARRIER);
+		b.fileobj->size = size;
+	}
+	return cannyfs_add_write(options.eagertruncate, cpath, fi, [size](const cannyfs_path& path, const fuse_file_info* fi) {
+		int res = ftruncate(getfh(fi), size);
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int cannyfs_truncate(const char *cpath, off_t size, struct fuse_file_info *fi)
+{
+	return fi ? cannyfs_ftruncate(cpath, size, fi) : cannyfs_truncate(cpath, size);
+}
+#endif
+
+#ifdef HAVE_UTIMENSAT
+static int cannyfs_utimens(const char *cpath, const struct timespec ts[2])
+{
+	struct timespec ts2[2] = { ts[0], ts[1] };
+	return cannyfs_add_write(options.eagerutimens, cpath, [ts2](const cannyfs_path& path) {
+		int res;
+
+		int dirfd;
+		const char* name;
+		auto dir = dirfds.at(path, dirfd, name);
+		/* don't use utime/utimes since they follow symlinks */
+		res = utimensat(dirfd, name, ts2, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+}
+
+#if FUSE_USE_VERSION >= 30
+static int cannyfs_utimens(const char *cpath, const struct timespec ts[2], struct fuse_file_info *fi)
+{
+	return cannyfs_utimens(cpath, ts);
+}
+#endif
+#endif
+
+// With the writeback cache, the kernel may read pages of files opened only for writing,
+// and it positions O_APPEND writes itself
+static void cannyfs_writebackflags(struct fuse_file_info *fi)
+{
+	if (!writebackcache) return;
+
+	if ((fi->flags & O_ACCMODE) == O_WRONLY)
+	{
+		fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+	}
+	fi->flags &= ~O_APPEND;
+}
+
+// The backend open of a handle that was handed out before it, created if mode is given. Like a create,
+// an eager open can start a chain.
+static auto cannyfs_openop(mode_t mode, bool created)
+{
+	return [mode, created](const cannyfs_path& path, const fuse_file_info* fi)
+	{
+		cannyfs_filehandle* cfh = getcfh(fi->fh);
+		if (cfh->movedto)
+		{
+			ensure_parent(*cfh->movedto, cfh->movedafter);
+		}
+		cannyfs_syscall call = cannyfs_syscall::open(cfh->movedto ? *cfh->movedto : path, fi->flags, mode);
+		// Opened as a direct descriptor in a chain, no one else will use the handle before its release
+		call.slot = cannyfs_chainslot();
+		call.then = [path, created, fh = fi->fh, chained = call.slot >= 0](int fd)
+		{
+			if (created)
+				cannyfs_pendingchild(path, -1);
+			if (fd < 0 || chained)
+				return min(fd, 0);
+
+			getcfh(fh)->setfh(fd);
+			return 0;
+		};
+
+		return call;
+	};
+}
+
+static int cannyfs_create(const char *cpath, mode_t mode, struct fuse_file_info *fi)
+{
+	if (options.verbose) fprintf(stderr, "Going to create %s with mode %d\n", cpath, (int) mode);
+	cannyfs_writebackflags(fi);
+	fi->fh = getnewfh() - fhs.begin();
+	{
+		cannyfs_reader b(cpath, NO_BARRIER | LOCK_WHOLE);
+		b.fileobj->stats.mode = mode | S_IFREG;
+		b.fileobj->mark(FILE_CREATED);
+		b.fileobj->mark(FILE_MISSING, false);
+	}
+	cannyfs_dirchild(cpath, true);
+	cannyfs_pendingchild(cpath, 1);
+
+	return cannyfs_add_write(options.eagercreate, cpath, fi, cannyfs_openop(mode, true), false, nullptr, OP_CREATE);
+}
+
+// Whether the backend open can be queued, because we know it will succeed. That is for a regular file
+// we made, or one that only has writes through an earlier handle pending, as long as its mode lets us in.
+static bool cannyfs_eageropen(cannyfs_filedata* file, int flags)
+{
+	if (file->is(FILE_MISSING) || !file->is(FILE_CREATED | FILE_HASTRUESTAT) || !S_ISREG(file->stats.mode))
+	{
+		return false;
+	}
+
+	mode_t needed = 0;
+	if ((flags & O_ACCMODE) != O_WRONLY) needed |= S_IRUSR;
+	if ((flags & O_ACCMODE) != O_RDONLY) needed |= S_IWUSR;
+	if ((file->stats.mode & needed) != needed)
+	{
+		return false;
+	}
+
+	if (file->is(FILE_CREATED))
+	{
+		return true;
+	}
+
+	if (!file->opstate || file->opstate->ops.empty())
+	{
+		return false;
+	}
+	for (const cannyfs_op& op : file->opstate->ops)
+	{
+		if (op.kind != OP_OPEN && op.kind != OP_WRITE && op.kind != OP_FLUSH && op.kind != OP_RELEASE)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int cannyfs_open(const char *path, struct fuse_file_info *fi)
+{
+	if (options.verbose) fprintf(stderr, "Going to open %s\n", path);
+	fi->fh = getnewfh() - fhs.begin();
+	cannyfs_writebackflags(fi);
+	if (options.eageropen)
+	{
+		bool eager;
+		{
+			cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+			eager = cannyfs_eageropen(b.fileobj, fi->flags);
+			if (eager && (fi->flags & O_TRUNC))
+			{
+				b.fileobj->size = 0;
+			}
+		}
+		if (eager)
+		{
+			return cannyfs_add_write(true, path, fi, cannyfs_openop(0, false), false, nullptr, OP_OPEN);
+		}
+	}
+
+	cannyfs_reader b(path, JUST_BARRIER);
+	int fd;
+
+	fd = cannyfs_syscall::open(path, fi->flags, 0).direct();
+	if (fd < 0)
+		return fd;
+	{
+		cannyfs_reader b2(path, NO_BARRIER);
+		b.fileobj->mark(FILE_MISSING, false);
+	}
+
+	getcfh(fi->fh)->setfh(fd);
+	return 0;
+}
 
-	if (options.eageraccess) return 0;
+struct cannyfs_readstats
+{
+	atomic_llong staged{ 0 };
+	atomic_llong overlaid{ 0 };
+	atomic_llong unblocked{ 0 };
+	atomic_llong drained{ 0 };
+
+	void report()
+	{
+		if (!staged && !overlaid && !unblocked && !drained) return;
+
+		cerr << "[cannyfs] Reads with writes queued: " << staged << " served from staged payloads, " << overlaid << " laid over the backend, "
+			<< unblocked << " straight from the backend, " << drained << " waited for the queue.\n";
+	}
+} readstats;
+
+// Serve a read while writes to the file are still queued, without waiting for them: the payloads they have staged
+// are laid over what the backend has. buf is allocated with malloc if null. Returns false if the read has to wait for
+// the queue after all, as another kind of op is pending, or a payload it needs is already on its way to the backend.
+static bool cannyfs_stagedread(const cannyfs_path& path, char*& buf, size_t size, off_t offset, struct fuse_file_info *fi, int& res)
+{
+	if (!options.stagedreads) return false;
+
+	vector<shared_ptr<cannyfs_pendingwrite> > overlapping;
+	{
+		cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+		cannyfs_opstate* state = b.fileobj->opstate.get();
+		if (!state || state->firstEventId >= state->lastEventId)
+		{
+			return false;
+		}
+		if (state->lastOtherEventId > state->firstEventId)
+		{
+			readstats.drained++;
+			return false;
+		}
+		overlapping = state->overlapping(offset, size);
+	}
+
+	// Only the backend can fill in what the payloads leave uncovered
+	const off_t end = offset + size;
+	vector<pair<off_t, off_t> > spans;
+	for (auto& write : overlapping)
+	{
+		spans.push_back({ max(write->offset, offset), min(write->offset + write->size, end) });
+	}
+	sort(spans.begin(), spans.end());
+	off_t reach = offset;
+	for (auto& span : spans)
+	{
+		if (span.first > reach) break;
+		reach = max(reach, span.second);
+	}
+	const bool covered = reach >= end;
+
+	if (!buf)
+	{
+		buf = (char*) malloc(size);
+		if (!buf)
+		{
+			res = -ENOMEM;
+			return true;
+		}
+	}
+
+	int length = 0;
+	if (!covered)
+	{
+		{
+			// The rest has to come from the backend, which a held file is not on yet
+			cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+			b.fileobj->letgo();
+		}
+		length = pread(getfh(fi), buf, size, offset);
+		if (length == -1)
+		{
+			res = -errno;
+			return true;
+		}
+		memset(buf + length, 0, size - length);
+	}
+
+	// Oldest first, so that later writes land on top
+	for (auto& write : overlapping)
+	{
+		off_t from = max(write->offset, offset);
+		off_t to = min(write->offset + write->size, end);
+		if (!write->peek(buf + (from - offset), from - write->offset, to - from))
+		{
+			readstats.drained++;
+			return false;
+		}
+		length = max(length, (int) (to - offset));
+	}
+
+	(overlapping.empty() ? readstats.unblocked : covered ? readstats.staged : readstats.overlaid)++;
+	res = length;
+	return true;
+}
+
+// The event that a read of [offset, offset + size) has to wait for. Queued writes elsewhere in the file
+// don't matter, any other kind of op might.
+static long long cannyfs_readbarrier(const cannyfs_path& path, off_t offset, size_t size)
+{
+	if (!options.rangebarriers) return numeric_limits<long long>::max();
+
+	cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+	cannyfs_opstate* state = b.fileobj->opstate.get();
+	if (!state) return -1;
+
+	long long target = state->lastOtherEventId;
+	for (auto& write : state->overlapping(offset, size))
+	{
+		target = max(target, write->eventId);
+	}
+
+	return target;
+}
+
+static int cannyfs_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	int res;
+	if (cannyfs_stagedread(path, buf, size, offset, fi, res))
+	{
+		return res;
+	}
+
+	cannyfs_reader b(path, JUST_BARRIER, cannyfs_readbarrier(path, offset, size));
+
+	(void) path;
+	res = pread(getfh(fi), buf, size, offset);
+	if (res == -1)
+		res = -errno;
+
+	return res;
+}
+
+static int cannyfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+	char* mem = NULL;
+	int res;
+	if (cannyfs_stagedread(path, mem, size, offset, fi, res))
+	{
+		if (res < 0)
+		{
+			free(mem);
+			return res;
+		}
+
+		// Freed by the caller, like any memory buffer
+		src = new fuse_bufvec;
+		*src = FUSE_BUFVEC_INIT((size_t) res);
+		src->buf[0].mem = mem;
+		*bufp = src;
+		return 0;
+	}
+	free(mem);
+
+	cannyfs_reader b(path, JUST_BARRIER, cannyfs_readbarrier(path, offset, size));
+
+	(void) path;
+
+	src = new fuse_bufvec;
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+
+	src->buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	src->buf[0].fd = getfh(fi);
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+
+	return 0;
+}
+
+static int cannyfs_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	// TODO, NO WRITE, JUST WRITE_BUF???
+	abort();
+	int res;
+
+	(void) path;
+	res = pwrite(getfh(fi), buf, size, offset);
+	if (res == -1)
+		res = -errno;
+
+	return res;
+}
+
+// Drain the pipes of first and all writes it absorbed into payload, returns the number of bytes
+static int cannyfs_gatherwrite(shared_ptr<cannyfs_pendingwrite> first, cannyfs_writepayload& payload)
+{
+	vector<cannyfs_pendingwrite*> parts{ first.get() };
+	for (auto& write : first->merged)
+	{
+		parts.push_back(write.get());
+	}
+
+	// On failure, the pipes we consumed still hold data and can't go back to the pool
+	size_t consumed = 0;
+	auto fail = [&parts, &consumed](int err)
+	{
+		for (size_t i = 0; i < consumed; i++)
+		{
+			piper.closepipe(parts[i]->pipe);
+		}
+		return err;
+	};
+
+	for (auto part : parts)
+	{
+		if (!part->consume())
+		{
+			return fail(-EIO);
+		}
+		consumed++;
+	}
+
+	// Spilled payloads are written straight from the arena, only the piped parts are copied out
+	payload.write = first;
+	vector<unique_ptr<char[]> >& data = payload.data;
+	vector<iovec>& iov = payload.iov;
+	int total = 0;
+	for (auto part : parts)
+	{
+		if (part->piped)
+		{
+			data.emplace_back(new char[part->piped]);
+			char* target = data.back().get();
+			int val = 0;
+			while (val < part->piped)
+			{
+				int ret = read(part->pipe.first, target + val, part->piped - val);
+				if (ret <= 0)
+				{
+					if (ret < 0 && errno == EINTR) continue;
+					return fail(ret < 0 ? -errno : -EIO);
+				}
+				val += ret;
+			}
+			iov.push_back({ target, (size_t) part->piped });
+		}
+		if (part->spill)
+		{
+			iov.push_back({ part->spill, (size_t) (part->size - part->piped) });
+		}
+		total += part->size;
+	}
+
+	for (auto part : parts)
+	{
+		piper.returnpipe(part->pipe);
+	}
+
+	if (parts.size() > 1)
+	{
+		writestats.coalescedwrites++;
+		writestats.coalescedops += parts.size();
+	}
+
+	return total;
+}
+
+// Write out first and all writes it absorbed with a single pwritev
+static int cannyfs_writecoalesced(shared_ptr<cannyfs_pendingwrite> first, int fd)
+{
+	cannyfs_writepayload payload;
+	int total = cannyfs_gatherwrite(first, payload);
+	if (total < 0)
+	{
+		return total;
+	}
+
+	vector<iovec>& iov = payload.iov;
+	int val = 0;
+	size_t index = 0;
+	while (val < total)
+	{
+		int ret = pwritev(fd, &iov[index], iov.size() - index, first->offset + val);
+		if (ret < 0)
+		{
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		val += ret;
+
+		// Skip past what was written, possibly ending in the middle of a part
+		while (ret > 0 && ret >= (int) iov[index].iov_len)
+		{
+			ret -= iov[index].iov_len;
+			index++;
+		}
+		if (ret > 0)
+		{
+			iov[index].iov_base = (char*) iov[index].iov_base + ret;
+			iov[index].iov_len -= ret;
+		}
+	}
+
+	return first->size;
+}
+
+// Write out a single staged write, splicing its pipe into the file
+static int cannyfs_writepiped(shared_ptr<cannyfs_pendingwrite> write, int fd)
+{
+	if (!write->merged.empty())
+	{
+		return cannyfs_writecoalesced(write, fd);
+	}
+
+	if (!write->consume())
+	{
+		piper.closepipe(write->pipe);
+		return -EIO;
+	}
+
+	const int sz = write->size;
+	const off_t offset = write->offset;
+	const cannyfs_pipefds pipe = write->pipe;
+	int piped = write->piped;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t) piped);
+
+	dst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = fd;
+	dst.buf[0].pos = offset;
+
+	struct fuse_bufvec newsrc = FUSE_BUFVEC_INIT((size_t) piped);
+	newsrc.buf[0].fd = pipe.first;
+	newsrc.buf[0].flags = (fuse_buf_flags)(FUSE_BUF_FD_RETRY | FUSE_BUF_IS_FD);
+
+	int val = 0;
+
+	while (val < piped)
+	{
+		// Hand the pipe pages over to the file instead of copying them
+		int ret = fuse_buf_copy(&dst, &newsrc, FUSE_BUF_SPLICE_MOVE);
+		if (ret < 0)
+		{
+			piper.closepipe(pipe);
+			return ret;
+		}
+
+		val += ret;
+	}
+
+	piper.returnpipe(pipe);
+
+	while (val < sz)
+	{
+		int ret = pwrite(fd, write->spill + (val - piped), sz - val, offset + val);
+		if (ret < 0)
+		{
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+
+		val += ret;
+	}
+
+	return val;
+}
+
+// The payloads of write and the writes it absorbed have reached the backend, or never will
+static void cannyfs_unstage(const cannyfs_path& path, cannyfs_pendingwrite* write)
+{
+	unique_lock<mutex> lock;
+	cannyfs_filedata* file = filemap.get(path, false, lock);
+	if (!file) return;
+
+	if (file->opstate)
+	{
+		file->opstate->unstage(write);
+		for (auto& merged : write->merged)
+		{
+			file->opstate->unstage(merged.get());
+		}
+		file->trim();
+	}
+	lock.unlock();
+	filemap.release(file);
+}
+
+// Whether the queue of path is held for packing. Its writes are then staged in memory, they are small
+// and may wait a while for the release.
+static bool cannyfs_held(const cannyfs_path& path)
+{
+	if (options.packsmallfiles <= 0) return false;
+
+	cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
+	return b.fileobj->opstate && b.fileobj->opstate->held;
+}
+
+static int cannyfs_write_buf(const char *cpath, struct fuse_bufvec *buf,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	cannyfs_filehandle* cfh = getcfh(fi->fh);
+
+	int sz = fuse_buf_size(buf);
+	cannyfs_pipefds pipe = cannyfs_held(cpath) ? NO_PIPE : piper.getpipe();
+	auto write = make_shared<cannyfs_pendingwrite>(fi->fh, offset, sz, pipe);
+
+	// Staged before the op is queued, which might block in admission control. The op can then always run,
+	// and retire to make room for us.
+	int val = cannyfs_stagewrite(*write, buf);
+	write->setstaged(val >= 0);
+	if (val < 0)
+	{
+		piper.closepipe(write->pipe);
+		return val;
+	}
+
+	int toret = cannyfs_add_write(true, cpath, fi, [sz, offset, write](const cannyfs_path& path, const fuse_file_info *fi) {
+		if (write->absorbed)
+		{
+			// Already written out by the op that absorbed it
+			return cannyfs_syscall::done(sz);
+		}
+
+		int slot = cannyfs_chainslot();
+		if (slot < 0)
+		{
+			int res = cannyfs_writepiped(write, getfh(fi));
+			cannyfs_unstage(path, write.get());
+			return cannyfs_syscall::done(res);
+		}
+
+		// The file is opened earlier in the chain, the data follows in a vectored write to its direct descriptor
+		auto payload = make_shared<cannyfs_writepayload>();
+		int total = cannyfs_gatherwrite(write, *payload);
+		if (total < 0)
+		{
+			cannyfs_unstage(path, write.get());
+			return cannyfs_syscall::done(total);
+		}
+
+		cannyfs_syscall call = cannyfs_syscall::writev(-1, offset, move(payload));
+		call.slot = slot;
+		call.then = [path, write, sz, total](int res)
+		{
+			cannyfs_unstage(path, write.get());
+			return res < 0 ? res : res < total ? -EIO : sz;
+		};
+
+		return call;
+	}, false, write, OP_WRITE);
+
+	if (toret < 0)
+	{
+		return toret;
+	}
+
+	{
+		cannyfs_reader b(cpath, NO_BARRIER);
+		off_t maybenewsize = (off_t)(offset + val);
+		update_maximum(b.fileobj->size, maybenewsize);
+	}
+	
+	return val;
+}
 
+static int cannyfs_statfs(const char *path, struct statvfs *stbuf)
+{
+	cannyfs_reader b(path, JUST_BARRIER);
 	int res;
 
-	res = access(path, mask);
+	res = statvfs(path, stbuf);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
-static int cannyfs_readlink(const char *path, char *buf, size_t size)
+static int cannyfs_flush(const char *cpath, struct fuse_file_info *fi)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
+	if (options.closeverylate)
+	{
+		// Just adding it to the close list might lock, if we don't have an fh yet
+		return cannyfs_add_write(options.eagerflush, cpath, fi, [](const cannyfs_path& path, const fuse_file_info *fi) {
+			closes.emplace_back(dup(getfh(fi)));
 
-	int res;
+			// TODO: Adjust return value if dup fails?
+			return 0;
+		});
+	}
 
-	res = readlink(path, buf, size - 1);
-	if (res == -1)
-		return -errno;
+	return cannyfs_add_write(options.eagerflush, cpath, fi, [](const cannyfs_path& path, const fuse_file_info *fi) {
+		/* This is called from every close on an open file, so call the
+		   close on the underlying filesystem.	But since flush may be
+		   called multiple times for an open file, this must not really
+		   close the file.  This is important if used on a network
+		   filesystem like NFS which flush the data/metadata on close() */
+		if (cannyfs_chainslot() >= 0)
+		{
+			// The chain closes the file right after anyway
+			return cannyfs_syscall::done(0);
+		}
 
-	buf[res] = '\0';
-	return 0;
-}
+		int fd = dup(getfh(fi));
+		if (fd == -1)
+			return cannyfs_syscall::done(-errno);
 
-struct cannyfs_dirp {
-	DIR *dp;
-	struct dirent *entry;
-	off_t offset;
-};
+		return cannyfs_syscall::close(fd);
+	}, false, nullptr, OP_FLUSH);
+}
 
-static int cannyfs_opendir(const char *path, struct fuse_file_info *fi)
+static int cannyfs_release(const char *cpath, struct fuse_file_info *fi)
 {
-	// With accurate dirs, ALL operations need to finish
-	cannyfs_dirreader b(path, JUST_BARRIER);
-
-	int res;
-	cannyfs_dirp* d = new cannyfs_dirp;
-	if (d == NULL)
-		return -ENOMEM;
+	if (options.closeverylate)
+	{
+		// Just adding it to the close list might lock, if we don't have an fh yet
+		return cannyfs_add_write(options.eagerclose, cpath, fi, [](const cannyfs_path& path, const fuse_file_info *fi) {
+			closes.emplace_back(getfh(fi));
 
-	d->dp = opendir(path);
-	if (d->dp == NULL) {
-		res = -errno;
-		free(d);
-		return res;
+			return 0;
+		});
 	}
-	d->offset = 0;
-	d->entry = NULL;
 
-	fi->fh = getnewfh() - fhs.begin();
-	getcfh(fi->fh)->setfh((unsigned long)d);
-	return 0;
+	return cannyfs_add_write(options.eagerclose, cpath, fi, [](const cannyfs_path& path, const fuse_file_info *fi) {
+		int slot = cannyfs_chainslot();
+		int fd = slot >= 0 ? -1 : getfh(fi);
+		getcfh(fi->fh)->~cannyfs_filehandle();
+		// Reset object using default constructor
+		new(getcfh(fi->fh)) cannyfs_filehandle();
+		freefhs.push(fhs.begin() + fi->fh);
+
+		cannyfs_syscall call = cannyfs_syscall::close(fd);
+		call.slot = slot;
+		return call;
+	}, false, nullptr, OP_RELEASE);
 }
 
-static inline struct cannyfs_dirp *get_dirp(struct fuse_file_info *fi)
+static int cannyfs_fsync(const char *cpath, int isdatasync,
+		     struct fuse_file_info *fi)
 {
-	return (struct cannyfs_dirp *) (uintptr_t) getfh(fi);
-}
+	if (options.ignorefsync) return 0;
 
-static int cannyfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi
-#if FUSE_USE_VERSION >= 30
-		       , enum fuse_readdir_flags flags
+	return cannyfs_add_write(options.eagerfsync, cpath, fi, [isdatasync](const cannyfs_path& path, const fuse_file_info *fi) {
+		(void)path;
+
+#ifndef HAVE_FDATASYNC
+		(void) isdatasync;
+		return cannyfs_syscall::fsync(getfh(fi), false);
+#else
+		return cannyfs_syscall::fsync(getfh(fi), isdatasync);
 #endif
-)
-{
-	bf::path parsedpath = path;
-	cannyfs_dirreader b(parsedpath, JUST_BARRIER);
+	});
+}
 
-	struct cannyfs_dirp *d = get_dirp(fi);
+#ifdef HAVE_POSIX_FALLOCATE
+static int cannyfs_fallocate(const char *cpath, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	if (mode)
+		return -EOPNOTSUPP;
 
-	(void) path;
-	if (offset != d->offset) {
-		seekdir(d->dp, offset);
-		d->entry = NULL;
-		d->offset = offset;
+	return cannyfs_add_write(options.eagerchown, cpath, fi, [mode, offset, length](const cannyfs_path& path, struct fuse_file_info *fi) {
+		return -posix_fallocate(getfh(fi), offset, length);
 	}
-	while (1) {
-		struct stat st;
-		off_t nextoff;
-#if FUSE_USE_VERSION >= 30
-		enum fuse_fill_dir_flags fill_flags = (fuse_fill_dir_flags) 0;
+}
 #endif
 
-		if (!d->entry) {
-			d->entry = readdir(d->dp);			
-			if (!d->entry)
-				break;
-			if (options.statwhenreaddir)
-			{
-				cannyfs_add_write(true, (parsedpath / d->entry->d_name).string(), [](const std::string& path)
-				{ 
-					struct stat statdata;
-					if (lstat(path.c_str(), &statdata) == 0)
-					{
-						cannyfs_reader b(path, NO_BARRIER | LOCK_WHOLE);
-						b.fileobj->stats = statdata;
-						b.fileobj->hastruestat = true;						
-					}
+#ifdef HAVE_SETXATTR
+/* xattr operations are optional and can safely be left unimplemented */
+static int cannyfs_setxattr(const char *path, const char *cname, const char *cvalue,
+			size_t size, int flags)
+{
+	std::string name = cname;
+	std::string value = cvalue;
 
-					return 0;
-				});
-			}
-		}
-#if FUSE_USE_VERSION >= 30
-#ifdef HAVE_FSTATAT
-		if (flags & FUSE_READDIR_PLUS) {
-			int res;
+	return cannyfs_add_write(options.eagerxattr, path, [name, value, size, flags] (const cannyfs_path& path)
+	{
+		int res = lsetxattr(path.c_str(), name.c_str(), value.c_str(), size, flags);
+		if (res == -1)
+			return -errno;
 
-			res = fstatat(dirfd(d->dp), d->entry->d_name, &st,
-				      AT_SYMLINK_NOFOLLOW);
-			if (res != -1)
-				fill_flags |= FUSE_FILL_DIR_PLUS;
-		}
-#endif
-		if (!(fill_flags & FUSE_FILL_DIR_PLUS)) {
-#endif
-			memset(&st, 0, sizeof(st));
-			st.st_ino = d->entry->d_ino;
-			st.st_mode = d->entry->d_type << 12;
-#if FUSE_USE_VERSION >= 30
-		}
-#endif
-		nextoff = telldir(d->dp);
-		if (filler(buf, d->entry->d_name, &st, nextoff
-#if FUSE_USE_VERSION >= 30
-			, fill_flags
-#endif
-		))
-			break;
+		return 0;
+	});
+}
 
-		d->entry = NULL;
-		d->offset = nextoff;
-	}
+static int cannyfs_getxattr(const char *path, const char *name, char *value,
+			size_t size)
+{
+	cannyfs_reader b(path, JUST_BARRIER);
 
-	return 0;
+	int res = lgetxattr(path, name, value, size);
+	if (res == -1)
+		return -errno;
+	return res;
 }
 
-static int cannyfs_releasedir(const char *path, struct fuse_file_info *fi)
+static int cannyfs_listxattr(const char *path, char *list, size_t size)
 {
-	struct cannyfs_dirp *d = get_dirp(fi);
-	(void) path;
-	closedir(d->dp);
-	free(d);
-	return 0;
+	cannyfs_reader b(path, JUST_BARRIER);
+
+	int res = llistxattr(path, list, size);
+	if (res == -1)
+		return -errno;
+	return res;
 }
 
-static int cannyfs_mknod(const char *path, mode_t mode, dev_t rdev)
+static int cannyfs_removexattr(const char *path, const char *cname)
+{
+	std::string name = cname;
+	return cannyfs_add_write(options.eagerxattr, path, [name](const cannyfs_path& path)
+	{
+		int res = lremovexattr(path.c_str(), name.c_str());
+		if (res == -1)
+			return -errno;
+
+		return 0;
+	});
+}
+#endif /* HAVE_SETXATTR */
+
+#ifdef HAVE_LIBULOCKMGR
+static int cannyfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		    struct flock *lock)
+{
+	cannyfs_immediatewriter b(path, JUST_BARRIER);
+
+	return ulockmgr_op(getfh(fi), cmd, lock, &fi->lock_owner,
+			   sizeof(fi->lock_owner));
+}
+#endif
+
+static int cannyfs_flock(const char *path, struct fuse_file_info *fi, int op)
 {
+	// TODO: cannyfs_immediatewriter INSTEAD
+	cannyfs_reader b(path, JUST_BARRIER);
 	int res;
 
-	if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
-	else
-		res = mknod(path, mode, rdev);
+	res = flock(getfh(fi), op);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
-static int cannyfs_mkdir(const char *path, mode_t mode)
+// Shared by both frontends
+static void cannyfs_setupconn(struct fuse_conn_info* conn)
 {
+	// Started here rather than in main, the reaper thread wouldn't survive daemonizing
+	if (!strcmp(options.backend, "uring") && !uring.active())
 	{
-		cannyfs_reader b(path, LOCK_WHOLE);
-		b.fileobj->missing = false;
-		b.fileobj->created = true;
-		b.fileobj->stats.st_mode = mode | S_IFDIR;
+		if (options.restrictivedirs)
+		{
+			// Finishing an op then waits for the whole tree, which would stall the reaper
+			cerr << "[cannyfs] --restrictivedirs needs the synchronous backend.\n";
+		}
+		else
+		{
+			uring.start(options.uringentries);
+		}
 	}
 
-	return cannyfs_add_write(options.eagermkdir, path, [mode](const std::string& path) {
-		int res = mkdir(path.c_str(), mode);
-		if (res == -1)
-			return -errno;
+	// Let a single pipe hold the largest write the kernel will send us
+	piper.setsize(conn->max_write);
 
-		return 0;
-	});
+#if FUSE_USE_VERSION >= 30
+	auto want = [conn](unsigned int cap, bool on)
+	{
+		if (on && (conn->capable & cap))
+		{
+			conn->want |= cap;
+		}
+		else
+		{
+			conn->want &= ~cap;
+		}
+
+		return (conn->want & cap) ? "on" : "off";
+	};
+
+	// The kernel gathers small writes into large ones, and only has to send them by close
+	const char* writeback = want(FUSE_CAP_WRITEBACK_CACHE, options.writeback);
+	writebackcache = conn->want & FUSE_CAP_WRITEBACK_CACHE;
+	// Listings carry attributes from the stat model, saving a lookup per entry
+	const char* readdirplus = want(FUSE_CAP_READDIRPLUS, options.readdirplus);
+	// Ordering within a dir is ours to keep anyway, the kernel need not serialize lookups and creates
+	const char* parallel = want(FUSE_CAP_PARALLEL_DIROPS, true);
+
+	cerr << "[cannyfs] Kernel features: writeback cache " << writeback << ", readdirplus " << readdirplus << ", parallel dirops " << parallel << ".\n";
+#endif
 }
 
-void rm_bookkeeping(const char* path)
+#if FUSE_USE_VERSION >= 30
+static void* cannyfs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
 {
-	bf::path parsedpath = path;
-	
-	cannyfs_reader b(parsedpath, NO_BARRIER);
-	b.fileobj->missing = true;
-	b.fileobj->created = false;
-	b.fileobj->size = 0;
-	cannyfs_reader bp(parsedpath.parent_path(), NO_BARRIER | LOCK_WHOLE);
-	bp.fileobj->removers.insert(b.fileobj);
+	cannyfs_setupconn(conn);
+
+	return NULL;
+}
+#else
+static void* cannyfs_init(struct fuse_conn_info* conn)
+{
+	cannyfs_setupconn(conn);
+
+	return NULL;
 }
+#endif
 
+// Inode numbers handed to the kernel by the low-level frontend. Each is a pointer to one of these,
+// which holds the interned path it currently names. Renames rewrite the path, so the kernel's
+// inodes stay valid, and the filemap is still reached through the path.
+struct cannyfs_inode
+{
+	mutex lock;
+	cannyfs_path path;
+	// The rest is guarded by the shard lock of the current path
+	uint64_t nlookup = 0;
+	bool dir;
+	bool detached = false;
 
-static int cannyfs_unlink(const char *path)
+	cannyfs_inode(const cannyfs_path& path, bool dir) : path(path), dir(dir)
+	{
+	}
+
+	cannyfs_path get()
+	{
+		lock_guard<mutex> _(lock);
+		return path;
+	}
+
+	void set(const cannyfs_path& newpath)
+	{
+		lock_guard<mutex> _(lock);
+		path = newpath;
+	}
+};
+
+struct cannyfs_inodes
 {
-	// We should KILL all pending IOs, not let them go through to some corpse. Or, well,
-	// we should have a flag to do that.
-	// TODO: cannyfs_clear(path);
-	rm_bookkeeping(path);
+private:
+	static const int SHARDS = 64;
+
+	struct shard
+	{
+		unordered_multimap<size_t, cannyfs_inode*, cannyfs_identityhash> inodes;
+		mutex lock;
+
+		cannyfs_inode* find(const cannyfs_path& path)
+		{
+			auto range = inodes.equal_range(path.hash());
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				if (i->second->path == path)
+				{
+					return i->second;
+				}
+			}
+
+			return nullptr;
+		}
+
+		void erase(cannyfs_inode* inode)
+		{
+			auto range = inodes.equal_range(inode->path.hash());
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				if (i->second == inode)
+				{
+					inodes.erase(i);
+					return;
+				}
+			}
+		}
+	};
 
-	return cannyfs_add_write(options.eagerunlink, path, [](const std::string& path) {
-		int res;
+	shard shards[SHARDS];
 
-		res = unlink(path.c_str());
-		if (res == -1)
-			return -errno;
+	shard& shardfor(const cannyfs_path& path)
+	{
+		return shards[path.hash() % SHARDS];
+	}
 
-		return 0;
-	});
-}
+public:
+	const cannyfs_path root{ "/" };
+	atomic_llong live{ 0 };
+	atomic_llong lookups{ 0 };
+	atomic_llong rewrites{ 0 };
 
-static int cannyfs_rmdir(const char *path)
-{
-	rm_bookkeeping(path);
+	cannyfs_path path(fuse_ino_t ino)
+	{
+		if (ino == FUSE_ROOT_ID) return root;
 
-	// Quite dangerous unless restrictive dirs is turned on, even if eagerrmdir is false!
-	return cannyfs_add_write(options.eagerrmdir, path, [](const std::string& path) {
-		int res;
+		return ((cannyfs_inode*) ino)->get();
+	}
 
-		res = rmdir(path.c_str());
-		if (res == -1)
-			return -errno;
+	// Count one kernel lookup of path and return its inode number
+	fuse_ino_t lookup(const cannyfs_path& path, bool dir)
+	{
+		if (path == root) return FUSE_ROOT_ID;
 
-		return 0;
-	}, true);
-}
+		lookups++;
+		shard& s = shardfor(path);
+		lock_guard<mutex> _(s.lock);
+		cannyfs_inode* inode = s.find(path);
+		if (!inode)
+		{
+			inode = new cannyfs_inode(path, dir);
+			s.inodes.emplace(path.hash(), inode);
+			live++;
+		}
+		inode->nlookup++;
 
-static int cannyfs_symlink(const char *from, const char *to)
-{
-	{
-		cannyfs_reader b(to, NO_BARRIER | LOCK_WHOLE);
-		b.fileobj->missing = false;
-		b.fileobj->created = true;
-		b.fileobj->stats.st_mode = S_IRUSR | S_IWUSR | S_IFLNK;
+		return (fuse_ino_t) inode;
 	}
-	return cannyfs_add_write(options.eagersymlink, (bf::path(to).parent_path() / from).string(), to, [fromreal = string(from)](const std::string& from, const std::string& to) {
-		int res;
 
-		res = symlink(fromreal.c_str(), to.c_str());
-		if (res == -1)
-			return -errno;
+	void forget(fuse_ino_t ino, uint64_t nlookup)
+	{
+		if (ino == FUSE_ROOT_ID) return;
 
-		return 0;
-	});
-}
+		cannyfs_inode* inode = (cannyfs_inode*) ino;
+		while (true)
+		{
+			cannyfs_path current = inode->get();
+			shard& s = shardfor(current);
+			unique_lock<mutex> l(s.lock);
+			// A rename moved it in the meantime
+			if (!(inode->path == current)) continue;
 
-static int cannyfs_rename(const char *from, const char *to
-#if FUSE_USE_VERSION >= 30
-	, unsigned int flags
-#endif
-)
-{
+			inode->nlookup -= nlookup;
+			if (inode->nlookup) return;
+
+			if (!inode->detached) s.erase(inode);
+			l.unlock();
+			delete inode;
+			live--;
+
+			return;
+		}
+	}
+
+	// The name is gone, whatever the kernel still holds for it must not be found by new lookups
+	void detach(const cannyfs_path& path)
 	{
-		cannyfs_reader b1(from, NO_BARRIER | LOCK_WHOLE);
-		cannyfs_reader b2(to, NO_BARRIER | LOCK_WHOLE);
-		b1.fileobj->missing = true;
-		b2.fileobj->missing = false;
-		b2.fileobj->created = true;
-		if (b1.fileobj->hastruestat)
-		{
-			b1.fileobj->hastruestat = false;
-			b2.fileobj->stats = b1.fileobj->stats;
-		}	
-		else
+		shard& s = shardfor(path);
+		lock_guard<mutex> _(s.lock);
+		cannyfs_inode* inode = s.find(path);
+		if (inode)
 		{
-			b2.fileobj->stats.st_mode = S_IRUSR | S_IWUSR | S_IFREG;
+			s.erase(inode);
+			inode->detached = true;
 		}
 	}
-	return cannyfs_add_write(options.eagerrename, from, to, [](const std::string& from, const std::string& to) {
-		int res;
 
-#if FUSE_USE_VERSION >= 30
-		/* When we have renameat2() in libc, then we can implement flags */
-		if (flags)
-			return -EINVAL;
-#endif
+	void rename(const cannyfs_path& from, const cannyfs_path& to, bool exchange = false)
+	{
+		// Rare enough to just stop the world
+		unique_lock<mutex> locks[SHARDS];
+		for (int i = 0; i < SHARDS; i++)
+		{
+			locks[i] = unique_lock<mutex>(shards[i].lock);
+		}
 
-		res = rename(from.c_str(), to.c_str());
-		if (res == -1)
-			return -errno;
+		cannyfs_inode* source = shardfor(from).find(from);
+		cannyfs_inode* target = shardfor(to).find(to);
+		if (target && !exchange)
+		{
+			shardfor(to).erase(target);
+			target->detached = true;
+			target = nullptr;
+		}
 
-		return 0;
-	});
-}
+		// Everything the kernel knows below a moved dir has to follow it
+		vector<pair<cannyfs_inode*, cannyfs_path>> moves;
+		auto follow = [&](cannyfs_inode* inode, const cannyfs_path& oldpath, const cannyfs_path& newpath)
+		{
+			if (!inode) return;
 
-static int cannyfs_link(const char *cfrom, const char *cto)
-{
-	// TODO: Add created directory entry.
-	return cannyfs_add_write(options.eagerlink, cfrom, cto, [](const std::string& from, const std::string& to) {
-		int res;
+			moves.emplace_back(inode, newpath);
+			if (!inode->dir) return;
 
-		res = link(from.c_str(), to.c_str());
-		if (res == -1)
-			return -errno;
+			const string prefix = oldpath.str() + "/";
+			for (shard& s : shards)
+			{
+				for (auto& entry : s.inodes)
+				{
+					const string& path = entry.second->path.str();
+					if (!path.compare(0, prefix.size(), prefix))
+					{
+						moves.emplace_back(entry.second, cannyfs_path(newpath.str() + path.substr(oldpath.str().size())));
+					}
+				}
+			}
+		};
+		follow(source, from, to);
+		follow(target, to, from);
 
-		return 0;
-	});
-}
+		for (auto& m : moves)
+		{
+			shardfor(m.first->path).erase(m.first);
+		}
+		for (auto& m : moves)
+		{
+			m.first->set(m.second);
+			shardfor(m.second).inodes.emplace(m.second.hash(), m.first);
+			rewrites++;
+		}
+	}
 
-static int cannyfs_chmod(const char *cpath, mode_t mode)
-{
+	void report()
 	{
-		cannyfs_reader b(cpath, LOCK_WHOLE);
-		// TODO: Is this mask defined somewhere for real?
-		mode_t newmode = b.fileobj->stats.st_mode;
-		newmode &= numeric_limits<mode_t>::max() - 0xFFF;
-		newmode |= mode;
-
-		b.fileobj->stats.st_mode = newmode;
+		cerr << "[cannyfs] Inodes: " << live << " live, " << lookups << " lookups, " << rewrites << " rewritten by renames.\n";
 	}
-	return cannyfs_add_write(options.eagerchmod, cpath, [mode](const std::string& path) {
-		int res;
-		res = chmod(path.c_str(), mode);
-		if (res == -1)
-			return -errno;
-
-		return 0;
-	});
-}
+} inodes;
 
-static int cannyfs_chown(const char *cpath, uid_t uid, gid_t gid)
+// Lets the path based ops convert the c_str() of paths we resolved back without a lookup
+struct cannyfs_resolved
 {
-	return cannyfs_add_write(options.eagerchown, cpath, [uid, gid](const std::string& path) {
-		int res;
+	cannyfs_resolved(const cannyfs_path& path, const cannyfs_path* other = nullptr)
+	{
+		cannyfs_resolvedpaths[0] = &path;
+		cannyfs_resolvedpaths[1] = other;
+	}
 
-		res = lchown(path.c_str(), uid, gid);
-		if (res == -1)
-			return -errno;
+	~cannyfs_resolved()
+	{
+		cannyfs_resolvedpaths[0] = nullptr;
+		cannyfs_resolvedpaths[1] = nullptr;
+	}
+};
 
-		return 0;
-	});
-}
+static const double CANNYFS_LL_TIMEOUT = 1.0;
+// What the high-level libfuse lists entries with when it doesn't know their inode. Never 0, which readdir()
+// in older glibc skips as a deleted entry.
+static const ino_t CANNYFS_UNKNOWN_INO = 0xffffffff;
 
-static int cannyfs_truncate(const char *cpath, off_t size)
+static void cannyfs_ll_reply_entry(fuse_req_t req, const cannyfs_path& path, int res, fuse_file_info* fi = nullptr)
 {
+	fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	if (!res)
 	{
-		cannyfs_reader b(cpath, NO_BARRIER);
-		b.fileobj->size = size;
+		cannyfs_resolved r(path);
+		res = cannyfs_getattr(path.c_str(), &e.attr);
+	}
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
 	}
-	return cannyfs_add_write(options.eagertruncate, cpath, [size](const std::string& path) {
-		int res = truncate(path.c_str(), size);
-		if (res == -1)
-			return -errno;
 
-		return 0;
-	});
+	e.ino = inodes.lookup(path, S_ISDIR(e.attr.st_mode));
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = CANNYFS_LL_TIMEOUT;
+	e.entry_timeout = CANNYFS_LL_TIMEOUT;
+	if (fi)
+	{
+		fuse_reply_create(req, &e, fi);
+	}
+	else
+	{
+		fuse_reply_entry(req, &e);
+	}
 }
 
-static int cannyfs_ftruncate(const char *cpath, off_t size,
-			 struct fuse_file_info *fi)
+static void cannyfs_ll_reply_attr(fuse_req_t req, fuse_ino_t ino, const cannyfs_path& path)
 {
+	struct stat st;
+	cannyfs_resolved r(path);
+	int res = cannyfs_getattr(path.c_str(), &st);
+	if (res)
 	{
-		cannyfs_reader b(cpath, NO_BARRIER);
-		b.fileobj->size = size;
+		fuse_reply_err(req, -res);
+		return;
 	}
-	return cannyfs_add_write(options.eagertruncate, cpath, fi, [size](const std::string& path, const fuse_file_info* fi) {
-		int res = ftruncate(getfh(fi), size);
-		if (res == -1)
-			return -errno;
 
-		return 0;
-	});
-
-	return 0;
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, CANNYFS_LL_TIMEOUT);
 }
 
-#ifdef HAVE_UTIMENSAT
-static int cannyfs_utimens(const char *cpath, const struct timespec ts[2])
+static void cannyfs_ll_init(void* userdata, struct fuse_conn_info* conn)
 {
-	struct timespec ts2[2] = { ts[0], ts[1] };
-	return cannyfs_add_write(options.eagerutimens, cpath, [ts2](const std::string& path) {
-		int res;
+	cannyfs_setupconn(conn);
+}
 
-		/* don't use utime/utimes since they follow symlinks */
-		res = utimensat(0, path.c_str(), ts2, AT_SYMLINK_NOFOLLOW);
-		if (res == -1)
-			return -errno;
+static void cannyfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	cannyfs_ll_reply_entry(req, inodes.path(parent).child(name), 0);
+}
 
-		return 0;
-	});
+static void cannyfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	inodes.forget(ino, nlookup);
+	fuse_reply_none(req);
 }
-#endif
 
-static int cannyfs_create(const char *cpath, mode_t mode, struct fuse_file_info *fi)
+static void cannyfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
 {
-	if (options.verbose) fprintf(stderr, "Going to create %s with mode %d\n", cpath, (int) mode);
-	fi->fh = getnewfh() - fhs.begin();
+	for (size_t i = 0; i < count; i++)
 	{
-		cannyfs_reader b(cpath, NO_BARRIER | LOCK_WHOLE);
-		b.fileobj->stats.st_mode = mode | S_IFREG;
-		b.fileobj->created = true;
-		b.fileobj->missing = false;
+		inodes.forget(forgets[i].ino, forgets[i].nlookup);
 	}
-
-	return cannyfs_add_write(options.eagercreate, cpath, fi, [mode](const std::string& path, const fuse_file_info* fi)
-	{
-		int fd = open(path.c_str(), fi->flags, mode);
-		if (fd == -1)
-			return -errno;
-
-		getcfh(fi->fh)->setfh(fd);
-		return 0;
-	});
+	fuse_reply_none(req);
 }
 
-static int cannyfs_open(const char *path, struct fuse_file_info *fi)
+static void cannyfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-	// TODO: Depending on the state of the parent directory and previous operations on the file,
-	// this could reasonably be made eager sometimes.
-	cannyfs_reader b(path, JUST_BARRIER);
-	if (options.verbose) fprintf(stderr, "Going to open %s\n", path);
-	int fd;
+	cannyfs_ll_reply_attr(req, ino, inodes.path(ino));
+}
 
-	fi->fh = getnewfh() - fhs.begin();
-	fd = open(path, fi->flags);
-	if (fd == -1)
-		return -errno;
+static void cannyfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
+{
+	cannyfs_path path = inodes.path(ino);
+	int res = 0;
 	{
-		cannyfs_reader b2(path, NO_BARRIER);
-		b.fileobj->missing = false;
+		cannyfs_resolved r(path);
+		if (!res && (to_set & FUSE_SET_ATTR_MODE))
+		{
+			res = cannyfs_chmod(path.c_str(), attr->st_mode & 07777);
+		}
+		if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+		{
+			res = cannyfs_chown(path.c_str(),
+				(to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+				(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+		}
+		if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+		{
+			res = fi ? cannyfs_ftruncate(path.c_str(), attr->st_size, fi) : cannyfs_truncate(path.c_str(), attr->st_size);
+		}
+#ifdef HAVE_UTIMENSAT
+		if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+		{
+			struct timespec ts[2];
+			ts[0].tv_nsec = UTIME_OMIT;
+			ts[1].tv_nsec = UTIME_OMIT;
+			if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+			else if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+			if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+			else if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+			res = cannyfs_utimens(path.c_str(), ts);
+		}
+#endif
+	}
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
 	}
 
-	getcfh(fi->fh)->setfh(fd);
-	return 0;
+	cannyfs_ll_reply_attr(req, ino, path);
 }
 
-static int cannyfs_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+static void cannyfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
-	int res;
-
-	(void) path;
-	res = pread(getfh(fi), buf, size, offset);
-	if (res == -1)
-		res = -errno;
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	char buf[PATH_MAX + 1];
+	int res = cannyfs_readlink(path.c_str(), buf, sizeof(buf));
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-	return res;
+	fuse_reply_readlink(req, buf);
 }
 
-static int cannyfs_read_buf(const char *path, struct fuse_bufvec **bufp,
-			size_t size, off_t offset, struct fuse_file_info *fi)
+static void cannyfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
-	struct fuse_bufvec *src;
-
-	(void) path;
-
-	src = new fuse_bufvec;
-	if (src == NULL)
-		return -ENOMEM;
-
-	*src = FUSE_BUFVEC_INIT(size);
-
-	src->buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-	src->buf[0].fd = getfh(fi);
-	src->buf[0].pos = offset;
-
-	*bufp = src;
-
-	return 0;
+	cannyfs_path path = inodes.path(parent).child(name);
+	int res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_mknod(path.c_str(), mode, rdev);
+	}
+	cannyfs_ll_reply_entry(req, path, res);
 }
 
-static int cannyfs_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static void cannyfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
 {
-	// TODO, NO WRITE, JUST WRITE_BUF???
-	abort();
+	cannyfs_path path = inodes.path(parent).child(name);
 	int res;
-
-	(void) path;
-	res = pwrite(getfh(fi), buf, size, offset);
-	if (res == -1)
-		res = -errno;
-
-	return res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_mkdir(path.c_str(), mode);
+	}
+	cannyfs_ll_reply_entry(req, path, res);
 }
 
-static int cannyfs_write_buf(const char *cpath, struct fuse_bufvec *buf,
-		     off_t offset, struct fuse_file_info *fi)
+static void cannyfs_ll_symlink(fuse_req_t req, const char* link, fuse_ino_t parent, const char* name)
 {
-	cannyfs_filehandle* cfh = getcfh(fi->fh);
-
-	int sz = fuse_buf_size(buf);
-	// TODO:
-	// What should/could be done here is to first try a non-blocking pipe write. If that doesn't succeed, swallow the pill
-	// and get a user space buffer. Or linked list of pipes?
-	cannyfs_pipefds pipe = piper.getpipe();
-
-	int toret = cannyfs_add_write(true, cpath, fi, [sz, offset, pipe](const std::string& path, const fuse_file_info *fi) {
-
-		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sz);
-
-		dst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-		dst.buf[0].fd = getfh(fi);
-		dst.buf[0].pos = offset;
-
-		struct fuse_bufvec newsrc = FUSE_BUFVEC_INIT(sz);
-		newsrc.buf[0].fd = pipe.first;
-		newsrc.buf[0].flags = (fuse_buf_flags)(FUSE_BUF_FD_RETRY | FUSE_BUF_IS_FD);
-
-		pollfd srcpoll = { newsrc.buf[0].fd, POLLIN, 0 };
-
-		int val = 0;
-
-		while (val < sz)
-		{
-			while (poll(&srcpoll, 1, -1) <= 0) {}
-			int ret = fuse_buf_copy(&dst, &newsrc, (fuse_buf_copy_flags)0);
-			if (ret < 0)
-			{
-				close(pipe.first);
-				return ret;
-			}
-
-			val += ret;
-		}
-
-		piper.returnpipe(pipe);
-		return val;
-	});
-
-	if (toret < 0)
+	cannyfs_path path = inodes.path(parent).child(name);
+	int res;
 	{
-		return toret;
+		cannyfs_resolved r(path);
+		res = cannyfs_symlink(link, path.c_str());
 	}
+	cannyfs_ll_reply_entry(req, path, res);
+}
 
-	struct fuse_bufvec halfdst = FUSE_BUFVEC_INIT(sz);
-
-	halfdst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY);
-	halfdst.buf[0].fd = pipe.second;
+static void cannyfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
+{
+	cannyfs_path from = inodes.path(ino);
+	cannyfs_path to = inodes.path(newparent).child(newname);
+	int res;
+	{
+		cannyfs_resolved r(from, &to);
+		res = cannyfs_link(from.c_str(), to.c_str());
+	}
+	cannyfs_ll_reply_entry(req, to, res);
+}
 
-	int val = 0;
-	pollfd dstpoll = { halfdst.buf[0].fd, POLLOUT, 0 };
-	while (val < sz)
+static void cannyfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	cannyfs_path path = inodes.path(parent).child(name);
+	int res;
 	{
-		while (poll(&dstpoll, 1, -1) <= 0) {}
-		int ret = fuse_buf_copy(&halfdst, buf, (fuse_buf_copy_flags)0);
-		if (ret < 0)
-		{
-			close(pipe.second);
-			return ret;
-		}
+		cannyfs_resolved r(path);
+		res = cannyfs_unlink(path.c_str());
+	}
+	if (!res) inodes.detach(path);
+	fuse_reply_err(req, -res);
+}
 
-		val += ret;
+static void cannyfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	cannyfs_path path = inodes.path(parent).child(name);
+	int res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_rmdir(path.c_str());
 	}
+	if (!res) inodes.detach(path);
+	fuse_reply_err(req, -res);
+}
 
+static void cannyfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname
+#if FUSE_USE_VERSION >= 30
+	, unsigned int flags
+#endif
+)
+{
+#if FUSE_USE_VERSION < 30
+	const unsigned int flags = 0;
+#endif
+	cannyfs_path from = inodes.path(parent).child(name);
+	cannyfs_path to = inodes.path(newparent).child(newname);
+	int res;
 	{
-		cannyfs_reader b(cpath, NO_BARRIER);
-		off_t maybenewsize = (off_t)(offset + val);
-		update_maximum(b.fileobj->size, maybenewsize);
+		cannyfs_resolved r(from, &to);
+#if FUSE_USE_VERSION >= 30
+		res = cannyfs_rename(from.c_str(), to.c_str(), flags);
+#else
+		res = cannyfs_rename(from.c_str(), to.c_str());
+#endif
 	}
-	
-	return val;
+	if (!res) inodes.rename(from, to, flags & RENAME_EXCHANGE);
+	fuse_reply_err(req, -res);
 }
 
-static int cannyfs_statfs(const char *path, struct statvfs *stbuf)
+static void cannyfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
+	cannyfs_path path = inodes.path(parent).child(name);
 	int res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_create(path.c_str(), mode, fi);
+	}
+	cannyfs_ll_reply_entry(req, path, res, fi);
+}
 
-	res = statvfs(path, stbuf);
-	if (res == -1)
-		return -errno;
+static void cannyfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	int res = cannyfs_open(path.c_str(), fi);
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-	return 0;
+	fuse_reply_open(req, fi);
 }
 
-static int cannyfs_flush(const char *cpath, struct fuse_file_info *fi)
+static void cannyfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
 {
-	if (options.closeverylate)
+	cannyfs_path path = inodes.path(ino);
+	struct fuse_bufvec* buf = nullptr;
+	int res;
 	{
-		// Just adding it to the close list might lock, if we don't have an fh yet
-		return cannyfs_add_write(options.eagerflush, cpath, fi, [](const std::string& path, const fuse_file_info *fi) {
-			closes.emplace_back(dup(getfh(fi)));
+		cannyfs_resolved r(path);
+		res = cannyfs_read_buf(path.c_str(), &buf, size, off, fi);
+	}
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-			// TODO: Adjust return value if dup fails?
-			return 0;
-		});
+	fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+	if (!(buf->buf[0].flags & FUSE_BUF_IS_FD))
+	{
+		free(buf->buf[0].mem);
 	}
+	delete buf;
+}
 
-	return cannyfs_add_write(options.eagerflush, cpath, fi, [](const std::string& path, const fuse_file_info *fi) {
-		int res;
+static void cannyfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv, off_t off, struct fuse_file_info* fi)
+{
+	cannyfs_path path = inodes.path(ino);
+	int res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_write_buf(path.c_str(), bufv, off, fi);
+	}
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-		/* This is called from every close on an open file, so call the
-		   close on the underlying filesystem.	But since flush may be
-		   called multiple times for an open file, this must not really
-		   close the file.  This is important if used on a network
-		   filesystem like NFS which flush the data/metadata on close() */
-		res = close(dup(getfh(fi)));
-		if (res == -1)
-			return -errno;
+	fuse_reply_write(req, res);
+}
 
-		return 0;
-	});
+static void cannyfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	fuse_reply_err(req, -cannyfs_flush(path.c_str(), fi));
 }
 
-static int cannyfs_release(const char *cpath, struct fuse_file_info *fi)
+static void cannyfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-	if (options.closeverylate)
-	{
-		// Just adding it to the close list might lock, if we don't have an fh yet
-		return cannyfs_add_write(options.eagerclose, cpath, fi, [](const std::string& path, const fuse_file_info *fi) {
-			closes.emplace_back(getfh(fi));
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	fuse_reply_err(req, -cannyfs_release(path.c_str(), fi));
+}
 
-			return 0;
-		});
-	}
+static void cannyfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	fuse_reply_err(req, -cannyfs_fsync(path.c_str(), datasync, fi));
+}
 
-	return cannyfs_add_write(options.eagerclose, cpath, fi, [](const std::string& path, const fuse_file_info *fi) {
-		int fd = getfh(fi);
-		getcfh(fi->fh)->~cannyfs_filehandle();
-		// Reset object using default constructor
-		new(getcfh(fi->fh)) cannyfs_filehandle();
-		freefhs.push(fhs.begin() + fi->fh);
+// The whole listing is produced on the first readdir and served from here by offset
+struct cannyfs_lldir
+{
+	struct entry
+	{
+		string name;
+		struct stat st;
+		bool full;
+	};
 
-		return close(fd);
-	});
-}
+	uint64_t fh;
+	vector<entry> entries;
+};
 
-static int cannyfs_fsync(const char *cpath, int isdatasync,
-		     struct fuse_file_info *fi)
+static void cannyfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-	if (options.ignorefsync) return 0;
+	cannyfs_path path = inodes.path(ino);
+	int res;
+	{
+		cannyfs_resolved r(path);
+		res = cannyfs_opendir(path.c_str(), fi);
+	}
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-	return cannyfs_add_write(options.eagerfsync, cpath, fi, [isdatasync](const std::string& path, const fuse_file_info *fi) {
-		int res;
-		(void)path;
+	fi->fh = (uint64_t) new cannyfs_lldir{ fi->fh };
+	fuse_reply_open(req, fi);
+}
 
-#ifndef HAVE_FDATASYNC
-		(void) isdatasync;
+static int cannyfs_ll_filldir(const cannyfs_path& path, cannyfs_lldir* dir, struct fuse_file_info* fi, bool plus)
+{
+	struct filler
+	{
+		static int add(void* buf, const char* name, const struct stat* st, off_t
+#if FUSE_USE_VERSION >= 30
+			, enum fuse_fill_dir_flags flags
+#endif
+		)
+		{
+#if FUSE_USE_VERSION >= 30
+			const bool full = flags & FUSE_FILL_DIR_PLUS;
 #else
-		if (isdatasync)
-			res = fdatasync(getfh(fi));
-		else
+			const bool full = false;
 #endif
-			res = fsync(getfh(fi));
-		if (res == -1)
-			return -errno;
+			((cannyfs_lldir*) buf)->entries.push_back({ name, *st, full });
 
-		return 0;
-	});
-}
+			return 0;
+		}
+	};
 
-#ifdef HAVE_POSIX_FALLOCATE
-static int cannyfs_fallocate(const char *cpath, int mode,
-			off_t offset, off_t length, struct fuse_file_info *fi)
-{
-	if (mode)
-		return -EOPNOTSUPP;
+	cannyfs_resolved r(path);
+	fuse_file_info dirfi = *fi;
+	dirfi.fh = dir->fh;
+	dir->entries.clear();
 
-	return cannyfs_add_write(options.eagerchown, cpath, fi, [mode, offset, length](const std::string& path, struct fuse_file_info *fi) {
-		return -posix_fallocate(getfh(fi), offset, length);
-	}
-}
+	return cannyfs_readdir(path.c_str(), dir, filler::add, 0, &dirfi
+#if FUSE_USE_VERSION >= 30
+		, plus ? FUSE_READDIR_PLUS : (fuse_readdir_flags) 0
 #endif
+	);
+}
 
-#ifdef HAVE_SETXATTR
-/* xattr operations are optional and can safely be left unimplemented */
-static int cannyfs_setxattr(const char *path, const char *cname, const char *cvalue,
-			size_t size, int flags)
+static void cannyfs_ll_listdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi, bool plus)
 {
-	std::string name = cname;
-	std::string value = cvalue;
+	cannyfs_lldir* dir = (cannyfs_lldir*) fi->fh;
+	cannyfs_path path = inodes.path(ino);
+	if (!off)
+	{
+		int res = cannyfs_ll_filldir(path, dir, fi, plus);
+		if (res)
+		{
+			fuse_reply_err(req, -res);
+			return;
+		}
+	}
 
-	return cannyfs_add_write(options.eagerxattr, path, [name, value, size, flags] (const std::string& path)
+	string buf(size, '\0');
+	size_t used = 0;
+	for (size_t i = off; i < dir->entries.size(); i++)
 	{
-		int res = lsetxattr(path.c_str(), name.c_str(), value.c_str(), size, flags);
-		if (res == -1)
-			return -errno;
+		const cannyfs_lldir::entry& entry = dir->entries[i];
+		// Entries from our own listings, and ones made by us, are only known by name
+		struct stat st = entry.st;
+		if (!st.st_ino)
+		{
+			st.st_ino = CANNYFS_UNKNOWN_INO;
+		}
+#if FUSE_USE_VERSION >= 30
+		if (plus)
+		{
+			fuse_entry_param e;
+			memset(&e, 0, sizeof(e));
+			e.attr = st;
+			if (fuse_add_direntry_plus(req, NULL, 0, entry.name.c_str(), &e, i + 1) > size - used)
+			{
+				break;
+			}
 
-		return 0;
-	});
+			// Every entry with an inode counts as a lookup, so only hand them out for entries that fit
+			if (entry.full && entry.name != "." && entry.name != "..")
+			{
+				e.ino = inodes.lookup(path.child(entry.name.c_str()), S_ISDIR(entry.st.st_mode));
+				e.attr.st_ino = e.ino;
+				e.attr_timeout = CANNYFS_LL_TIMEOUT;
+				e.entry_timeout = CANNYFS_LL_TIMEOUT;
+			}
+			used += fuse_add_direntry_plus(req, &buf[used], size - used, entry.name.c_str(), &e, i + 1);
+			continue;
+		}
+#endif
+		size_t entsize = fuse_add_direntry(req, &buf[used], size - used, entry.name.c_str(), &st, i + 1);
+		if (entsize > size - used)
+		{
+			break;
+		}
+		used += entsize;
+	}
+
+	fuse_reply_buf(req, buf.data(), used);
 }
 
-static int cannyfs_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+static void cannyfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
+	cannyfs_ll_listdir(req, ino, size, off, fi, false);
+}
 
-	int res = lgetxattr(path, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
+#if FUSE_USE_VERSION >= 30
+static void cannyfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+	cannyfs_ll_listdir(req, ino, size, off, fi, true);
 }
+#endif
 
-static int cannyfs_listxattr(const char *path, char *list, size_t size)
+static void cannyfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-	cannyfs_reader b(path, JUST_BARRIER);
+	cannyfs_lldir* dir = (cannyfs_lldir*) fi->fh;
+	fuse_file_info dirfi = *fi;
+	dirfi.fh = dir->fh;
+	delete dir;
 
-	int res = llistxattr(path, list, size);
-	if (res == -1)
-		return -errno;
-	return res;
+	fuse_reply_err(req, -cannyfs_releasedir(nullptr, &dirfi));
 }
 
-static int cannyfs_removexattr(const char *path, const char *cname)
+static void cannyfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	std::string name = cname;
-	return cannyfs_add_write(options.eagerxattr, path, [name](const std::string& path)
+	cannyfs_path path = inodes.path(ino);
+	struct statvfs st;
+	int res;
 	{
-		int res = lremovexattr(path.c_str(), name.c_str());
-		if (res == -1)
-			return -errno;
+		cannyfs_resolved r(path);
+		res = cannyfs_statfs(path.c_str(), &st);
+	}
+	if (res)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
 
-		return 0;
-	});
+	fuse_reply_statfs(req, &st);
 }
-#endif /* HAVE_SETXATTR */
 
-#ifdef HAVE_LIBULOCKMGR
-static int cannyfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
-		    struct flock *lock)
+static void cannyfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	cannyfs_immediatewriter b(path, JUST_BARRIER);
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	fuse_reply_err(req, -cannyfs_access(path.c_str(), mask));
+}
 
-	return ulockmgr_op(getfh(fi), cmd, lock, &fi->lock_owner,
-			   sizeof(fi->lock_owner));
+static void cannyfs_ll_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi, int op)
+{
+	cannyfs_path path = inodes.path(ino);
+	cannyfs_resolved r(path);
+	fuse_reply_err(req, -cannyfs_flock(path.c_str(), fi, op));
 }
-#endif
 
-static int cannyfs_flock(const char *path, struct fuse_file_info *fi, int op)
+static struct fuse_lowlevel_ops cannyfs_lloper;
+
+static int cannyfs_lowlevel_main(struct fuse_args* args)
 {
-	// TODO: cannyfs_immediatewriter INSTEAD
-	cannyfs_reader b(path, JUST_BARRIER);
-	int res;
+	cannyfs_lloper.init = cannyfs_ll_init;
+	cannyfs_lloper.lookup = cannyfs_ll_lookup;
+	cannyfs_lloper.forget = cannyfs_ll_forget;
+	cannyfs_lloper.forget_multi = cannyfs_ll_forget_multi;
+	cannyfs_lloper.getattr = cannyfs_ll_getattr;
+	cannyfs_lloper.setattr = cannyfs_ll_setattr;
+	cannyfs_lloper.readlink = cannyfs_ll_readlink;
+	cannyfs_lloper.mknod = cannyfs_ll_mknod;
+	cannyfs_lloper.mkdir = cannyfs_ll_mkdir;
+	cannyfs_lloper.symlink = cannyfs_ll_symlink;
+	cannyfs_lloper.link = cannyfs_ll_link;
+	cannyfs_lloper.unlink = cannyfs_ll_unlink;
+	cannyfs_lloper.rmdir = cannyfs_ll_rmdir;
+	cannyfs_lloper.rename = cannyfs_ll_rename;
+	cannyfs_lloper.create = cannyfs_ll_create;
+	cannyfs_lloper.open = cannyfs_ll_open;
+	cannyfs_lloper.read = cannyfs_ll_read;
+	cannyfs_lloper.write_buf = cannyfs_ll_write_buf;
+	cannyfs_lloper.flush = cannyfs_ll_flush;
+	cannyfs_lloper.release = cannyfs_ll_release;
+	cannyfs_lloper.fsync = cannyfs_ll_fsync;
+	cannyfs_lloper.opendir = cannyfs_ll_opendir;
+	cannyfs_lloper.readdir = cannyfs_ll_readdir;
+#if FUSE_USE_VERSION >= 30
+	cannyfs_lloper.readdirplus = cannyfs_ll_readdirplus;
+#endif
+	cannyfs_lloper.releasedir = cannyfs_ll_releasedir;
+	cannyfs_lloper.statfs = cannyfs_ll_statfs;
+	cannyfs_lloper.access = cannyfs_ll_access;
+	cannyfs_lloper.flock = cannyfs_ll_flock;
 
-	res = flock(getfh(fi), op);
-	if (res == -1)
-		return -errno;
+#if FUSE_USE_VERSION >= 30
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(args, &opts) != 0 || !opts.mountpoint)
+	{
+		return 1;
+	}
 
-	return 0;
+	int res = -1;
+	struct fuse_session* se = fuse_session_new(args, &cannyfs_lloper, sizeof(cannyfs_lloper), NULL);
+	if (se)
+	{
+		if (fuse_set_signal_handlers(se) == 0)
+		{
+			if (fuse_session_mount(se, opts.mountpoint) == 0)
+			{
+				fuse_daemonize(opts.foreground);
+				if (opts.singlethread)
+				{
+					res = fuse_session_loop(se);
+				}
+				else
+				{
+					struct fuse_loop_config config;
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads = opts.max_idle_threads;
+					res = fuse_session_loop_mt(se, &config);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+	free(opts.mountpoint);
+#else
+	char* mountpoint;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+	{
+		return 1;
+	}
+
+	int res = -1;
+	struct fuse_chan* ch = fuse_mount(mountpoint, args);
+	if (ch)
+	{
+		struct fuse_session* se = fuse_lowlevel_new(args, &cannyfs_lloper, sizeof(cannyfs_lloper), NULL);
+		if (se)
+		{
+			if (fuse_daemonize(foreground) != -1 && fuse_set_signal_handlers(se) != -1)
+			{
+				fuse_session_add_chan(se, ch);
+				res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+#endif
+	inodes.report();
+
+	return res ? 1 : 0;
 }
 
 static struct fuse_operations cannyfs_oper;
@@ -1481,6 +6250,13 @@ static struct fuse_opt cannyfs_opts[] = {
 	FS_OPT("--verbose", verbose, true),
 	FS_OPT("--assumecreateddirempty", assumecreateddirempty, true),
 	FS_OPT("--cachemissing", cachemissing, true),
+	FS_OPT("--completedirs", completedirs, true),
+	FS_OPT("--memorylistings", memorylistings, true),
+	FS_OPT("--overlaydirs", overlaydirs, true),
+	FS_OPT("--stagedreads", stagedreads, true),
+	FS_OPT("--rangebarriers", rangebarriers, true),
+	FS_OPT("--elideunlinked", elideunlinked, true),
+	FS_OPT("--fuserenames", fuserenames, true),
 	FS_OPT("--ignorefsync", ignorefsync, true),
 	FS_OPT("--inaccuratestat", inaccuratestat, true),
 	FS_OPT("--restrictivedirs", restrictivedirs, true),
@@ -1494,6 +6270,7 @@ static struct fuse_opt cannyfs_opts[] = {
 	FS_OPT("--eagerfsync", eagerflush, true),
 	FS_OPT("--eagerlink", eagerlink, true),
 	FS_OPT("--eagermkdir", eagermkdir, true),
+	FS_OPT("--eageropen", eageropen, true),
 	FS_OPT("--eagerrename", eagerrename, true),
 	FS_OPT("--eagerrmdir", eagerrmdir, true),
 	FS_OPT("--eagersymlink", eagersymlink, true),
@@ -1503,6 +6280,13 @@ static struct fuse_opt cannyfs_opts[] = {
 	FS_OPT("--eagerxattr", eagerxattr, true),
 	FS_OPT("--noassumecreateddirempty", assumecreateddirempty, false),
 	FS_OPT("--nocachemissing", cachemissing, false),
+	FS_OPT("--nocompletedirs", completedirs, false),
+	FS_OPT("--nomemorylistings", memorylistings, false),
+	FS_OPT("--nooverlaydirs", overlaydirs, false),
+	FS_OPT("--nostagedreads", stagedreads, false),
+	FS_OPT("--norangebarriers", rangebarriers, false),
+	FS_OPT("--noelideunlinked", elideunlinked, false),
+	FS_OPT("--nofuserenames", fuserenames, false),
 	FS_OPT("--noignorefsync", ignorefsync, false),
 	FS_OPT("--noinaccuratestat", inaccuratestat, false),
 	FS_OPT("--norestrictivedirs", restrictivedirs, false),
@@ -1516,6 +6300,7 @@ static struct fuse_opt cannyfs_opts[] = {
 	FS_OPT("--noeagerfsync", eagerflush, false),
 	FS_OPT("--noeagerlink", eagerlink, false),
 	FS_OPT("--noeagermkdir", eagermkdir, false),
+	FS_OPT("--noeageropen", eageropen, false),
 	FS_OPT("--noeagerrename", eagerrename, false),
 	FS_OPT("--noeagerrmdir", eagerrmdir, false),
 	FS_OPT("--noeagersymlink", eagersymlink, false),
@@ -1524,6 +6309,22 @@ static struct fuse_opt cannyfs_opts[] = {
 	FS_OPT("--noeagerutimens", eagerutimens, false),
 	FS_OPT("--noeagerxattr", eagerxattr, false),
 	FS_OPT("--maxinflight %i", maxinflight, 300),
+	FS_OPT("--maxinflightbytes %lli", maxinflightbytes, 0),
+	FS_OPT("--maxpipebytes %lli", maxpipebytes, 0),
+	FS_OPT("--packsmallfiles %lli", packsmallfiles, 0),
+	FS_OPT("--workers %i", workers, 64),
+	FS_OPT("--maxtrackedpaths %i", maxtrackedpaths, 0),
+	FS_OPT("--maxdirfds %i", maxdirfds, 0),
+	FS_OPT("--lowlevel", lowlevel, true),
+	FS_OPT("--writeback", writeback, true),
+	FS_OPT("--nowriteback", writeback, false),
+	FS_OPT("--readdirplus", readdirplus, true),
+	FS_OPT("--noreaddirplus", readdirplus, false),
+	FS_OPT("--clonefd", clonefd, true),
+	FS_OPT("--noclonefd", clonefd, false),
+	FS_OPT("--maxidlethreads %i", maxidlethreads, 0),
+	FS_OPT("--backend=%s", backend, 0),
+	FS_OPT("--uringentries %i", uringentries, 0),
 	FUSE_OPT_END
 };
 
@@ -1532,13 +6333,18 @@ static struct fuse_opt cannyfs_opts[] = {
 int main(int argc, char *argv[])
 {
 	umask(0);
+#if FUSE_USE_VERSION < 30
 	cannyfs_oper.flag_nopath = 0;
 	cannyfs_oper.flag_reserved = 0;
+#endif
+	cannyfs_oper.init = cannyfs_init;
 	cannyfs_oper.getattr = cannyfs_getattr;
 	cannyfs_oper.readlink = cannyfs_readlink;
 	cannyfs_oper.mknod = cannyfs_mknod;
 	cannyfs_oper.mkdir = cannyfs_mkdir;
+#if FUSE_USE_VERSION < 30
 	cannyfs_oper.fgetattr = cannyfs_fgetattr;
+#endif
 	cannyfs_oper.access = cannyfs_access;
 
 	cannyfs_oper.opendir = cannyfs_opendir;
@@ -1554,7 +6360,9 @@ int main(int argc, char *argv[])
 	cannyfs_oper.chmod = cannyfs_chmod;
 	cannyfs_oper.chown = cannyfs_chown;
 	cannyfs_oper.truncate = cannyfs_truncate;
+#if FUSE_USE_VERSION < 30
 	cannyfs_oper.ftruncate = cannyfs_ftruncate;
+#endif
 #ifdef HAVE_UTIMENSAT
 	cannyfs_oper.utimens = cannyfs_utimens;
 #endif
@@ -1585,13 +6393,44 @@ int main(int argc, char *argv[])
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	fuse_opt_parse(&args, &options, cannyfs_opts, nullptr);
+	if (strcmp(options.backend, "sync") && strcmp(options.backend, "uring"))
+	{
+		cerr << "[cannyfs] Unknown backend " << options.backend << ", use sync or uring.\n";
+		return 1;
+	}
+#if FUSE_USE_VERSION >= 30
+	// Picked up by the session loop of either frontend
+	if (options.clonefd)
+	{
+		fuse_opt_add_arg(&args, "-oclone_fd");
+	}
+	if (options.maxidlethreads > 0)
+	{
+		fuse_opt_add_arg(&args, ("-omax_idle_threads=" + to_string(options.maxidlethreads)).c_str());
+	}
+#endif
 	signal(SIGUSR2, [](int) {
 		filemap.syncnow = true;
 	});
-	int toret = fuse_main(args.argc, args.argv, &cannyfs_oper, NULL);
+	int toret = options.lowlevel ? cannyfs_lowlevel_main(&args) : fuse_main(args.argc, args.argv, &cannyfs_oper, NULL);
 	cerr << "[cannyfs] Unmounted. Finishing sync.\n";
 	// Flush everything BEFORE reporting errors.
 	filemap.syncall();
+	uring.stop();
+	workqueue.stop();
+	workqueue.report();
+	uring.report();
+	admission.report();
+	writestats.report();
+	readstats.report();
+	elision.report();
+	holds.report();
+	arena.report();
+	piper.report();
+	filemap.report();
+	paths.report();
+	dirfds.report();
+	prefetch.report();
 	
 	if (errors.size())
 	{